@@ -0,0 +1,531 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include "../convolution.h"
+#include "../kernels/kernels.h"
+#include "../omp/processes.h"
+
+
+// The convolution() of each backend, renamed when compiled into this binary
+void convolutionSerial(Image *out, const Image &in, const Filter &filter, BorderMode border);
+void convolutionOmp(Image *out, const Image &in, const Filter &filter, BorderMode border);
+void convolutionPool(Image *out, const Image &in, const Filter &filter, BorderMode border);
+void convolutionFft(Image *out, const Image &in, const Filter &filter, BorderMode border);
+void convolveIterateSerial(Image &image, const Filter &filter, unsigned n, BorderMode border);
+void convolveIterateOmp(Image &image, const Filter &filter, unsigned n, BorderMode border);
+void convolveIteratePool(Image &image, const Filter &filter, unsigned n, BorderMode border);
+void convolveIterateFft(Image &image, const Filter &filter, unsigned n, BorderMode border);
+
+typedef void (*ConvolutionFunction)(Image*, const Image&, const Filter&, BorderMode);
+typedef void (*IterateFunction)(Image&, const Filter&, unsigned, BorderMode);
+
+// A NULL function stands for a ConvolutionPlan, built before the timing
+static const struct
+{
+    const char *name;
+    ConvolutionFunction function;
+    IterateFunction iterate;
+} backends[] = {
+    {"serial", convolutionSerial, convolveIterateSerial},
+    {"omp",    convolutionOmp,    convolveIterateOmp},
+    {"pool",   convolutionPool,   convolveIteratePool},
+    {"fft",    convolutionFft,    convolveIterateFft},
+    {"plan",   NULL,              NULL},
+};
+
+static const char *kinds[] = {"dense", "separable", "box", "fixed"};
+
+
+int usage(const char* bin)
+{
+    std::cerr << "Usage: " << bin << " [image sizes] [filter sizes] [kinds] [backends] [repetitions] [warmup]"
+              << std::endl
+              << "       " << bin << " --iterate [image sizes] [filter sizes] [iterations] [backends] [repetitions]"
+              << std::endl
+              << "       " << bin << " --processes [image sizes] [filter sizes] [max workers] [repetitions]"
+              << std::endl
+              << "Times every backend on synthetic images and filters, and writes one CSV row per case"
+              << std::endl
+              << "  image sizes   comma separated, widths of square images (256,1024)" << std::endl
+              << "  filter sizes  comma separated (3,5,9,15,31,63)" << std::endl
+              << "  kinds         dense, separable, box and/or fixed (all)" << std::endl
+              << "  backends      serial, omp, pool, fft and/or plan (all)" << std::endl
+              << "  repetitions   timed runs per case (10)" << std::endl
+              << "  warmup        untimed runs before them (2)" << std::endl
+              << "Any of them can be 'all' for the default. GFLOP/s count the dense cost, a multiply and"
+              << " an add per tap and channel, whichever kernel the backend picks" << std::endl
+              << "Every fixed case is checked: its coefficients against the double ones, and its output"
+              << " against the double precision one, within the error bound of the quantization" << std::endl
+              << "--iterate times convolveIterate (8 iterations by default) against as many calls, with the"
+              << " block and tile it picks, on dense filters (3,5,9) and images (1024,4096)" << std::endl
+              << "--processes times the omp backend on 1 to max worker processes (one per core), with the"
+              << " speedup and efficiency, on dense filters (3,9,15) and images (1024,4096)" << std::endl;
+    return 1;
+}
+
+
+static std::vector<std::string> splitList(const std::string &list)
+{
+    std::vector<std::string> items;
+    std::istringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ','))
+        if (!item.empty())
+            items.push_back(item);
+    return items;
+}
+
+
+static std::vector<size_t> parseSizes(const std::string &list)
+{
+    std::vector<size_t> sizes;
+    std::vector<std::string> items = splitList(list);
+    for (size_t i = 0; i < items.size(); ++i) {
+        const long size = atol(items[i].c_str());
+        if (size <= 0)
+            throw std::runtime_error("Invalid size " + items[i]);
+        sizes.push_back(size);
+    }
+    return sizes;
+}
+
+
+// Same pixels on every run and machine: mt19937 is fully specified
+static Image syntheticImage(size_t width, size_t height)
+{
+    std::mt19937 generator(width * 7919 + height);
+    Image image(width, height);
+    for (size_t y = 0; y < height; ++y) {
+        for (size_t x = 0; x < width; ++x) {
+            const uint32_t bits = generator();
+            image[y][x].r = bits;
+            image[y][x].g = bits >> 8;
+            image[y][x].b = bits >> 16;
+            image[y][x].a = bits >> 24;
+        }
+    }
+    return image;
+}
+
+
+// dense: random coefficients, neither separable nor sparse
+// separable: outer product of two random vectors
+// box: every coefficient the same
+// fixed: sharpening, negative coefficients around a centre that outweighs
+// them all, to be quantized
+// All of them add up to 1
+static Filter syntheticFilter(const std::string &kind, size_t size)
+{
+    std::mt19937 generator(size);
+    std::vector<double> column(size), row(size);
+    for (size_t i = 0; i < size; ++i) {
+        column[i] = 1 + generator() % 1000;
+        row[i] = 1 + generator() % 1000;
+    }
+
+    Filter filter(size);
+    double sum = 0;
+    for (size_t y = 0; y < size; ++y) {
+        for (size_t x = 0; x < size; ++x) {
+            if (kind == "dense")
+                filter[y][x] = 1 + generator() % 1000;
+            else if (kind == "fixed")
+                filter[y][x] = -(1.0 + generator() % 1000) / (1000 * size * size);
+            else if (kind == "separable")
+                filter[y][x] = column[y] * row[x];
+            else if (kind == "box")
+                filter[y][x] = 1;
+            else
+                throw std::runtime_error("Unknown filter kind " + kind);
+            sum += filter[y][x];
+        }
+    }
+    if (kind == "fixed") {
+        filter[size / 2][size / 2] += 1 - sum;
+        sum = 1;
+    }
+    for (size_t y = 0; y < size; ++y)
+        for (size_t x = 0; x < size; ++x)
+            filter[y][x] /= sum;
+
+    filter.plan();
+    return filter;
+}
+
+
+// Largest difference between the color channels of two images of the same size
+static int maxDifference(const Image &a, const Image &b)
+{
+    int largest = 0;
+    for (size_t y = 0; y < a.height; ++y) {
+        for (size_t x = 0; x < a.width; ++x) {
+            largest = std::max(largest, std::abs(a[y][x].r - b[y][x].r));
+            largest = std::max(largest, std::abs(a[y][x].g - b[y][x].g));
+            largest = std::max(largest, std::abs(a[y][x].b - b[y][x].b));
+        }
+    }
+    return largest;
+}
+
+
+// Largest difference, in steps, between a coefficient and its fixed point
+// one: at most half a step once rounded, unless it did not fit in 16 bits
+static double quantizationError(const Filter &filter)
+{
+    double largest = 0;
+    for (size_t y = 0; y < filter.height; ++y) {
+        for (size_t x = 0; x < filter.width; ++x) {
+            const double q = filter.fixed.coefficients[y * filter.width + x];
+            largest = std::max(largest, std::fabs(std::ldexp(filter[y][x], filter.fixed.shift) - q));
+        }
+    }
+    return largest;
+}
+
+
+// Milliseconds taken by each of the timed runs, sorted
+static std::vector<double> measure(const std::function<void()> &run, size_t repetitions, size_t warmup)
+{
+    for (size_t i = 0; i < warmup; ++i)
+        run();
+
+    std::vector<double> times;
+    for (size_t i = 0; i < repetitions; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        run();
+        auto end = std::chrono::steady_clock::now();
+        times.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+    }
+    std::sort(times.begin(), times.end());
+    return times;
+}
+
+
+// Indexes in backends of the names, all of them for "all"
+static bool selectBackends(const std::vector<std::string> &names, std::vector<size_t> *selected)
+{
+    const size_t nBackends = sizeof(backends) / sizeof(backends[0]);
+    for (size_t i = 0; i < names.size(); ++i) {
+        size_t b = 0;
+        while (b < nBackends && names[i] != backends[b].name)
+            ++b;
+        if (names[i] == "all") {
+            for (b = 0; b < nBackends; ++b)
+                selected->push_back(b);
+        }
+        else if (b < nBackends) {
+            selected->push_back(b);
+        }
+        else {
+            std::cerr << "Unknown backend " << names[i] << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// convolveIterate against as many calls to the backend, with the temporal
+// blocking iterationBlock picked for each case. A block of 1 means none
+static int iterateMain(int argc, const char *argv[])
+{
+    std::vector<size_t> imageSizes, filterSizes, selected;
+    size_t iterations = 8, repetitions = 5;
+
+    try {
+        std::string arguments[3] = {"1024,4096", "3,5,9", "all"};
+        for (int i = 2; i < std::min(argc, 6); ++i) {
+            if (i == 4)
+                iterations = atol(argv[i]);
+            else if (std::string(argv[i]) != "all")
+                arguments[i < 4 ? i - 2 : 2] = argv[i];
+        }
+
+        imageSizes = parseSizes(arguments[0]);
+        filterSizes = parseSizes(arguments[1]);
+        if (argc > 6)
+            repetitions = atol(argv[6]);
+        if (imageSizes.empty() || filterSizes.empty() || iterations == 0 || repetitions == 0
+            || !selectBackends(splitList(arguments[2]), &selected))
+            return usage(argv[0]);
+    }
+    catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return usage(argv[0]);
+    }
+
+    // Empty images first: nothing to do, and nothing to divide by
+    size_t failures = 0;
+    for (size_t s = 0; s < selected.size(); ++s) {
+        const IterateFunction iterate = backends[selected[s]].iterate;
+        if (!iterate)
+            continue;
+        for (size_t e = 0; e < 2; ++e) {
+            const size_t width = e ? 5 : 0, height = e ? 0 : 5;
+            Image empty(width, height);
+            try {
+                iterate(empty, syntheticFilter("dense", 3), iterations, BorderClamp);
+                if (empty.width != width || empty.height != height)
+                    throw std::runtime_error("the image changed size");
+            }
+            catch (const std::exception &error) {
+                std::cerr << backends[selected[s]].name << ": iterations on a " << width << "x" << height
+                          << " image: " << error.what() << std::endl;
+                ++failures;
+            }
+        }
+    }
+
+    std::cout << "backend,width,height,filter,iterations,block,tile_columns,tile_rows,"
+              << "repeated_ms,iterate_ms,speedup" << std::endl;
+
+    try {
+        for (size_t i = 0; i < imageSizes.size(); ++i) {
+            const size_t width = imageSizes[i], height = imageSizes[i];
+            const Image image = syntheticImage(width, height);
+
+            for (size_t f = 0; f < filterSizes.size(); ++f) {
+                const size_t size = filterSizes[f];
+                const Filter filter = syntheticFilter("dense", size);
+                size_t tileRows = 0, tileColumns = 0;
+                const size_t block = iterationBlock(filter, width, &tileRows, &tileColumns);
+
+                for (size_t s = 0; s < selected.size(); ++s) {
+                    const ConvolutionFunction function = backends[selected[s]].function;
+                    const IterateFunction iterate = backends[selected[s]].iterate;
+                    if (!iterate)
+                        continue;
+
+                    Image repeated, iterated, spare;
+                    const std::vector<double> repeatedTimes = measure([&]() {
+                        repeated = image;
+                        for (size_t n = 0; n < iterations; ++n) {
+                            function(&spare, repeated, filter, BorderWrap);
+                            std::swap(spare, repeated);
+                        }
+                    }, repetitions, 1);
+                    const std::vector<double> iterateTimes = measure([&]() {
+                        iterated = image;
+                        iterate(iterated, filter, iterations, BorderWrap);
+                    }, repetitions, 1);
+
+                    const double repeatedMedian = repeatedTimes[repeatedTimes.size() / 2];
+                    const double iterateMedian = iterateTimes[iterateTimes.size() / 2];
+                    std::cout << backends[selected[s]].name << "," << width << "," << height << ","
+                              << size << "," << iterations << "," << block << ","
+                              << (block > 1 ? tileColumns : width) << "," << (block > 1 ? tileRows : height) << ","
+                              << repeatedMedian << "," << iterateMedian << ","
+                              << repeatedMedian / iterateMedian << std::endl;
+
+                    // The blocking must not change a single value
+                    if (maxDifference(repeated, iterated) != 0) {
+                        std::cerr << backends[selected[s]].name << ": " << iterations << " iterations of "
+                                  << size << "x" << size << " differ from as many convolutions" << std::endl;
+                        ++failures;
+                    }
+                }
+            }
+        }
+    }
+    catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return failures ? 1 : 0;
+}
+
+
+// The omp backend on 1 to maxWorkers worker processes, against the serial one
+// Every run pays for the segments and the workers, as a real one would
+static int processesMain(int argc, const char *argv[])
+{
+    std::vector<size_t> imageSizes, filterSizes;
+    size_t maxWorkers = std::max(1u, std::thread::hardware_concurrency()), repetitions = 5;
+
+    try {
+        std::string arguments[2] = {"1024,4096", "3,9,15"};
+        for (int i = 2; i < std::min(argc, 4); ++i)
+            if (std::string(argv[i]) != "all")
+                arguments[i - 2] = argv[i];
+
+        imageSizes = parseSizes(arguments[0]);
+        filterSizes = parseSizes(arguments[1]);
+        if (argc > 4 && std::string(argv[4]) != "all")
+            maxWorkers = atol(argv[4]);
+        if (argc > 5)
+            repetitions = atol(argv[5]);
+        if (imageSizes.empty() || filterSizes.empty() || maxWorkers == 0 || repetitions == 0)
+            return usage(argv[0]);
+    }
+    catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return usage(argv[0]);
+    }
+
+    std::cout << "width,height,filter,workers,median_ms,best_ms,speedup,efficiency" << std::endl;
+
+    size_t failures = 0;
+    try {
+        for (size_t i = 0; i < imageSizes.size(); ++i) {
+            const size_t width = imageSizes[i], height = imageSizes[i];
+            const Image image = syntheticImage(width, height);
+
+            for (size_t f = 0; f < filterSizes.size(); ++f) {
+                const size_t size = filterSizes[f];
+                const Filter filter = syntheticFilter("dense", size);
+                Image reference;
+                convolutionSerial(&reference, image, filter, BorderWrap);
+
+                double single = 0;
+                for (size_t n = 1; n <= maxWorkers; ++n) {
+                    Image output;
+                    const std::vector<double> times = measure([&]() {
+                        processConvolution(&output, image, filter, BorderWrap, n);
+                    }, repetitions, 1);
+
+                    const double median = times[times.size() / 2];
+                    if (n == 1)
+                        single = median;
+                    std::cout << width << "," << height << "," << size << "," << n << ","
+                              << median << "," << times[0] << ","
+                              << single / median << "," << single / median / n << std::endl;
+
+                    // Each kernel sums in floating point in its own order, and truncates
+                    if (maxDifference(output, reference) > 1) {
+                        std::cerr << n << " workers: " << size << "x" << size << " differs from the serial"
+                                  << " backend by " << maxDifference(output, reference) << " levels" << std::endl;
+                        ++failures;
+                    }
+                }
+            }
+        }
+    }
+    catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return failures ? 1 : 0;
+}
+
+
+int main(int argc, const char *argv[])
+{
+    if (argc > 1 && std::string(argv[1]) == "--iterate")
+        return iterateMain(argc, argv);
+    if (argc > 1 && std::string(argv[1]) == "--processes")
+        return processesMain(argc, argv);
+
+    std::vector<size_t> imageSizes, filterSizes;
+    std::vector<std::string> kindNames, backendNames;
+    size_t repetitions = 10, warmup = 2;
+
+    try {
+        std::string arguments[4] = {"256,1024", "3,5,9,15,31,63", "all", "all"};
+        for (int i = 1; i < std::min(argc, 5); ++i)
+            if (std::string(argv[i]) != "all")
+                arguments[i - 1] = argv[i];
+
+        imageSizes = parseSizes(arguments[0]);
+        filterSizes = parseSizes(arguments[1]);
+        kindNames = (arguments[2] == "all") ? std::vector<std::string>(kinds, kinds + 4) : splitList(arguments[2]);
+        backendNames = splitList(arguments[3]);
+        if (argc > 5)
+            repetitions = atol(argv[5]);
+        if (argc > 6)
+            warmup = atol(argv[6]);
+        if (imageSizes.empty() || filterSizes.empty() || kindNames.empty() || backendNames.empty()
+            || repetitions == 0)
+            return usage(argv[0]);
+    }
+    catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return usage(argv[0]);
+    }
+
+    std::vector<size_t> selected;
+    if (!selectBackends(backendNames, &selected))
+        return usage(argv[0]);
+
+    std::cout << "backend,kind,width,height,filter,repetitions,median_ms,p95_ms,mpixels_s,gflops" << std::endl;
+
+    size_t failures = 0;
+    try {
+        for (size_t i = 0; i < imageSizes.size(); ++i) {
+            const size_t width = imageSizes[i], height = imageSizes[i];
+            const Image image = syntheticImage(width, height);
+
+            for (size_t k = 0; k < kindNames.size(); ++k) {
+                for (size_t f = 0; f < filterSizes.size(); ++f) {
+                    const size_t size = filterSizes[f];
+                    Filter filter = syntheticFilter(kindNames[k], size);
+
+                    // What the fixed point outputs are checked against
+                    const bool fixed = kindNames[k] == "fixed";
+                    Image reference;
+                    if (fixed) {
+                        convolutionSerial(&reference, image, filter, BorderWrap);
+                        filter.quantize();
+                        if (quantizationError(filter) > 0.5) {
+                            std::cerr << "fixed point " << size << "x" << size << ": coefficients off by "
+                                      << quantizationError(filter) << " steps, shift " << filter.fixed.shift
+                                      << std::endl;
+                            ++failures;
+                        }
+                    }
+
+                    for (size_t s = 0; s < selected.size(); ++s) {
+                        const ConvolutionFunction function = backends[selected[s]].function;
+                        Image output;
+                        std::unique_ptr<ConvolutionPlan> plan;
+                        std::function<void()> run;
+                        if (function) {
+                            run = [&]() { function(&output, image, filter, BorderWrap); };
+                        }
+                        else {
+                            plan.reset(new ConvolutionPlan(filter, width, height, BorderWrap));
+                            run = [&]() { plan->execute(&output, image); };
+                        }
+
+                        const std::vector<double> times = measure(run, repetitions, warmup);
+                        const double median = times[times.size() / 2];
+                        // Nearest rank
+                        const double p95 = times[static_cast<size_t>(std::ceil(0.95 * times.size())) - 1];
+                        const double pixels = static_cast<double>(width) * height;
+                        const double flops = pixels * 3 * 2 * size * size;
+
+                        std::cout << backends[selected[s]].name << "," << kindNames[k] << ","
+                                  << width << "," << height << "," << size << "," << repetitions << ","
+                                  << median << "," << p95 << ","
+                                  << pixels / median / 1e3 << "," << flops / median / 1e6 << std::endl;
+
+                        // Both are truncated, so they can also differ by one level
+                        const int difference = fixed ? maxDifference(output, reference) : 0;
+                        if (difference > std::floor(filter.fixed.errorBound) + 1) {
+                            std::cerr << backends[selected[s]].name << ": fixed point " << size << "x" << size
+                                      << " differs by " << difference << " levels, the bound is "
+                                      << filter.fixed.errorBound << std::endl;
+                            ++failures;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,233 @@
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include "bootstrap.h"
+#include "queue.h"
+#include "../kernels/kernels.h"
+
+
+// One image waiting for, or going through, a worker
+struct AsyncRequest
+{
+    Image in;
+    std::shared_ptr<const Filter> filter;
+    BorderMode border;
+    ConvolutionExecutor::Callback done;
+    CancellationToken token;
+
+    size_t pixels() const
+    {
+        return in.width * in.height;
+    }
+};
+
+
+struct ConvolutionExecutor::State
+{
+    size_t batchPixels;
+    BoundedQueue<AsyncRequest> queue;
+    std::vector<std::thread> threads;
+    std::atomic<bool> stopping;
+
+    State(size_t pending, size_t batchPixels): batchPixels(batchPixels), queue(std::max<size_t>(1, pending)),
+        stopping(false)
+    {
+    }
+
+    void worker();
+    void run(std::vector<AsyncRequest> &batch);
+    void run(AsyncRequest &request, std::unique_ptr<ConvolutionPlan> &plan);
+};
+
+
+// Hands the result over. What the callback throws has nowhere to go, and must
+// not take the worker down
+static void finish(AsyncRequest &request, Image &&output, std::exception_ptr error)
+{
+    try {
+        request.done(std::move(output), error);
+    }
+    catch (...) {
+    }
+}
+
+
+// One plan does for both: same image size, border and coefficients, planned
+// the same way
+static bool samePlan(const AsyncRequest &a, const AsyncRequest &b)
+{
+    const Filter &f = *a.filter, &g = *b.filter;
+    if (a.in.width != b.in.width || a.in.height != b.in.height || a.border != b.border)
+        return false;
+    if (f.width != g.width || f.height != g.height || f.box != g.box || f.terms.size() != g.terms.size()
+        || f.taps.size() != g.taps.size() || f.fixed.shift != g.fixed.shift
+        || f.fixed.coefficients != g.fixed.coefficients)
+        return false;
+    for (size_t y = 0; y < f.height; ++y)
+        if (!std::equal(f[y], f[y] + f.width, g[y]))
+            return false;
+    return true;
+}
+
+
+// Small images go through the plan, made by the first of them that runs,
+// large ones through convolution()
+void ConvolutionExecutor::State::run(AsyncRequest &request, std::unique_ptr<ConvolutionPlan> &plan)
+{
+    if (stopping || request.token.cancelled()) {
+        finish(request, Image(), std::make_exception_ptr(ConvolutionCancelled()));
+        return;
+    }
+
+    Image output;
+    std::exception_ptr error;
+    try {
+        if (request.pixels() <= batchPixels) {
+            if (!plan)
+                plan.reset(new ConvolutionPlan(*request.filter, request.in.width, request.in.height,
+                                               request.border));
+            plan->execute(&output, request.in);
+        }
+        else {
+            convolution(&output, request.in, *request.filter, request.border);
+        }
+    }
+    catch (...) {
+        error = std::current_exception();
+    }
+    request.in = Image();
+
+    // Unless it was cancelled meanwhile
+    if (error)
+        finish(request, Image(), error);
+    else if (request.token.cancelled())
+        finish(request, Image(), std::make_exception_ptr(ConvolutionCancelled()));
+    else
+        finish(request, std::move(output), std::exception_ptr());
+}
+
+
+// The requests that can share a plan run one after the other on it, so the
+// kernel, the border tables and the scratch buffers are worked out once
+void ConvolutionExecutor::State::run(std::vector<AsyncRequest> &batch)
+{
+    std::vector<bool> ran(batch.size(), false);
+    for (size_t i = 0; i < batch.size(); ++i) {
+        if (ran[i])
+            continue;
+
+        // Picked before any of them runs, as that lets go of its input
+        std::vector<size_t> group;
+        for (size_t j = i; j < batch.size(); ++j) {
+            if (!ran[j] && samePlan(batch[i], batch[j])) {
+                group.push_back(j);
+                ran[j] = true;
+            }
+        }
+
+        std::unique_ptr<ConvolutionPlan> plan;
+        for (size_t k = 0; k < group.size(); ++k)
+            run(batch[group[k]], plan);
+    }
+}
+
+
+void ConvolutionExecutor::State::worker()
+{
+    AsyncRequest request;
+    while (queue.pop(request)) {
+        // A small image takes the small ones right behind it along, a large
+        // one met on the way is run after them
+        std::vector<AsyncRequest> batch;
+        size_t pixels = request.pixels();
+        batch.push_back(std::move(request));
+
+        std::vector<AsyncRequest> left;
+        AsyncRequest next;
+        while (pixels <= batchPixels && queue.tryPop(next)) {
+            if (next.pixels() > batchPixels || pixels + next.pixels() > batchPixels) {
+                left.push_back(std::move(next));
+                break;
+            }
+            pixels += next.pixels();
+            batch.push_back(std::move(next));
+        }
+
+        run(batch);
+        run(left);
+    }
+}
+
+
+ConvolutionExecutor::ConvolutionExecutor(size_t workers, size_t pending, size_t batchPixels):
+    state(new State(pending, batchPixels))
+{
+    for (size_t i = 0; i < std::max<size_t>(1, workers); ++i)
+        state->threads.push_back(std::thread(&State::worker, state.get()));
+}
+
+
+ConvolutionExecutor::~ConvolutionExecutor()
+{
+    state->stopping = true;
+    state->queue.close();
+    for (size_t i = 0; i < state->threads.size(); ++i)
+        state->threads[i].join();
+}
+
+
+std::future<Image> ConvolutionExecutor::submit(Image in, const Filter &filter, BorderMode border,
+                                               const CancellationToken &token)
+{
+    std::shared_ptr<std::promise<Image> > promise = std::make_shared<std::promise<Image> >();
+    std::future<Image> future = promise->get_future();
+
+    submit(std::move(in), filter, border, [promise](Image &&output, std::exception_ptr error) {
+        if (error)
+            promise->set_exception(error);
+        else
+            promise->set_value(std::move(output));
+    }, token);
+
+    return future;
+}
+
+
+void ConvolutionExecutor::submit(Image in, const Filter &filter, BorderMode border, Callback done,
+                                 const CancellationToken &token)
+{
+    AsyncRequest request;
+    request.in     = std::move(in);
+    request.filter = std::make_shared<const Filter>(filter);
+    request.border = border;
+    request.done   = std::move(done);
+    request.token  = token;
+
+    if (!state->queue.push(std::move(request)))
+        throw std::runtime_error("The executor is stopping");
+}
+
+
+static ConvolutionExecutor& sharedExecutor()
+{
+    static const size_t workers = getenv("CONVOLUTION_ASYNC_WORKERS")
+        ? std::max(1l, atol(getenv("CONVOLUTION_ASYNC_WORKERS")))
+        : std::max(1u, std::thread::hardware_concurrency());
+    static ConvolutionExecutor executor(workers, 4 * workers);
+    return executor;
+}
+
+
+std::future<Image> convolveAsync(Image in, const Filter &filter, BorderMode border,
+                                 const CancellationToken &token)
+{
+    return sharedExecutor().submit(std::move(in), filter, border, token);
+}
+
+
+void convolveAsync(Image in, const Filter &filter, BorderMode border, ConvolutionExecutor::Callback done,
+                   const CancellationToken &token)
+{
+    sharedExecutor().submit(std::move(in), filter, border, std::move(done), token);
+}
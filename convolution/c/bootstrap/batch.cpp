@@ -0,0 +1,187 @@
+#include <algorithm>
+#include <atomic>
+#include <ctime>
+#include <dirent.h>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <thread>
+#include "bootstrap.h"
+#include "queue.h"
+
+
+// Images waiting between two stages, per worker of the next stage
+static const size_t queueDepth = 2;
+
+
+// One image going through the pipeline
+struct BatchJob
+{
+    std::string input, output;
+    // Set when the input is a raw image, it owns what image is a view on
+    std::shared_ptr<RawImageFile> mapping;
+    Image image;
+};
+
+
+// Regular files in a directory, or the lines of a list file
+static std::vector<std::string> listInputs(const std::string &path)
+{
+    std::vector<std::string> inputs;
+
+    struct stat st;
+    if (stat(path.c_str(), &st) < 0)
+        throw std::runtime_error("Could not open " + path);
+
+    if (S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(path.c_str());
+        if (!dir)
+            throw std::runtime_error("Could not open " + path);
+        while (struct dirent *entry = readdir(dir)) {
+            std::string file = path + "/" + entry->d_name;
+            if (entry->d_name[0] != '.' && stat(file.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+                inputs.push_back(file);
+        }
+        closedir(dir);
+        std::sort(inputs.begin(), inputs.end());
+    }
+    else {
+        std::ifstream list(path);
+        std::string line;
+        while (std::getline(list, line))
+            if (!line.empty())
+                inputs.push_back(line);
+    }
+
+    return inputs;
+}
+
+
+static std::string baseName(const std::string &path)
+{
+    size_t slash = path.rfind('/');
+    return (slash == std::string::npos) ? path : path.substr(slash + 1);
+}
+
+
+// Starts n threads running fn
+template <class Fn>
+static void startWorkers(size_t n, Fn fn, std::vector<std::thread> &threads)
+{
+    for (size_t i = 0; i < n; ++i)
+        threads.push_back(std::thread(fn));
+}
+
+
+static void joinWorkers(std::vector<std::thread> &threads)
+{
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+    threads.clear();
+}
+
+
+int runBatch(const std::string &inputList, const Filter &filter, const std::string &outputDir,
+             BorderMode border, size_t workers)
+{
+    const std::vector<std::string> inputs = listInputs(inputList);
+    const size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    const size_t coders = std::max<size_t>(1, cores / 4);
+
+    std::cout << "Batch:  " << inputs.size() << " images" << std::endl
+              << "Decoders: " << coders << ", workers: " << workers << ", encoders: " << coders << std::endl;
+
+    BoundedQueue<std::string> paths(queueDepth * coders);
+    BoundedQueue<BatchJob> decoded(queueDepth * workers), convolved(queueDepth * coders);
+    std::atomic<size_t> done(0), failed(0), bytes(0);
+    std::vector<std::thread> decoders, convolvers, encoders;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+
+    startWorkers(coders, [&] {
+        std::string path;
+        while (paths.pop(path)) {
+            try {
+                BatchJob job;
+                job.input  = path;
+                job.output = outputDir + "/" + baseName(path);
+                if (isRawImage(path)) {
+                    job.mapping.reset(new RawImageFile(path));
+                    job.image = job.mapping->view();
+                }
+                else {
+                    initImageFromFile(&job.image, path);
+                }
+                decoded.push(std::move(job));
+            }
+            catch (const std::exception &e) {
+                std::cerr << path << ": " << e.what() << std::endl;
+                ++failed;
+            }
+        }
+    }, decoders);
+
+    startWorkers(workers, [&] {
+        BatchJob job;
+        while (decoded.pop(job)) {
+            try {
+                Image output;
+                convolution(&output, job.image, filter, border);
+                bytes += job.image.width * job.image.height * sizeof(Pixel);
+
+                job.image = std::move(output);
+                job.mapping.reset();
+                convolved.push(std::move(job));
+            }
+            catch (const std::exception &e) {
+                std::cerr << job.input << ": " << e.what() << std::endl;
+                ++failed;
+            }
+        }
+    }, convolvers);
+
+    startWorkers(coders, [&] {
+        BatchJob job;
+        while (convolved.pop(job)) {
+            try {
+                if (isRawImage(job.output)) {
+                    RawImageFile output(job.output, job.image.width, job.image.height);
+                    Image view = output.view();
+                    view = job.image;
+                }
+                else {
+                    dumpImage(job.image, job.output);
+                }
+                ++done;
+            }
+            catch (const std::exception &e) {
+                std::cerr << job.output << ": " << e.what() << std::endl;
+                ++failed;
+            }
+        }
+    }, encoders);
+
+    // Each stage is closed once the one feeding it has finished
+    for (size_t i = 0; i < inputs.size(); ++i)
+        paths.push(inputs[i]);
+    paths.close();
+    joinWorkers(decoders);
+    decoded.close();
+    joinWorkers(convolvers);
+    convolved.close();
+    joinWorkers(encoders);
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    std::cout << "Processed " << done << " images (" << failed << " failed) in "
+              << elapsed << " seconds" << std::endl
+              << done / elapsed << " images/s, "
+              << bytes / elapsed / megabyte << " MB/s" << std::endl;
+
+    return failed ? -1 : 0;
+}
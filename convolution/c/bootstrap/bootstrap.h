@@ -1,10 +1,225 @@
 #ifndef _BOOTSTRAP_H_
 #define _BOOTSTRAP_H_
 
+#include <atomic>
+#include <cstdio>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <sys/types.h>
 #include "../convolution.h"
 
 void initFilterFromFile(Filter*, const std::string&);
+// Comma separated list of filter files
+void initFiltersFromFiles(std::vector<Filter>*, const std::string&);
+BorderMode parseBorderMode(const std::string&);
+// Images are read at the depth of the Magick build, and scaled to that of
+// their channels
 void initImageFromFile(Image*, const std::string&);
+void initImageFromFile(Image16*, const std::string&);
+void initImageFromFile(ImageF*, const std::string&);
+// Wider images are written at 16 bits per channel, if the format allows
 void dumpImage(const Image&, const std::string&);
+void dumpImage(const Image16&, const std::string&);
+void dumpImage(const ImageF&, const std::string&);
+// Gray images are loaded as a single plane, opaque ones without opacity
+void initImageFromFile(PlanarImage*, const std::string&);
+void dumpImage(const PlanarImage&, const std::string&);
+
+// Bytes in a MB, in every report of the tool
+static const double megabyte = 1e6;
+
+// Wall and CPU time, peak resident memory and bytes processed by each stage
+// of a run, reported as a table or as a single JSON line
+class StageProfile
+{
+public:
+    StageProfile();
+
+    // Ends the current stage, if any, and starts timing the next one
+    void start(const std::string &stage);
+
+    // Ends the current stage, which processed the given number of bytes
+    void stop(size_t bytes = 0);
+
+    // JSON if CONVOLUTION_PROFILE is "json", the table otherwise
+    void report(std::ostream &out) const;
+
+private:
+    struct Stage
+    {
+        std::string name;
+        double wall, cpu;   // Milliseconds
+        long peakRss;       // KiB, the high water mark of the process when it ended
+        size_t bytes;
+    };
+
+    std::vector<Stage> stages;
+    bool running;
+    double wallStart, cpuStart;
+};
+
+// Convolves every image listed in inputList (a directory, or a file with
+// one path per line) into outputDir, keeping the names
+// Decoding, convolution (on `workers` threads) and encoding overlap
+int runBatch(const std::string &inputList, const Filter &filter, const std::string &outputDir,
+             BorderMode border, size_t workers);
+
+// What the futures of cancelled convolutions throw, and their callbacks get
+class ConvolutionCancelled: public std::runtime_error
+{
+public:
+    ConvolutionCancelled(): std::runtime_error("Convolution cancelled")
+    {
+    }
+};
+
+// Set by the caller once it no longer needs the result of a convolution
+// Copies share the flag, so one can be kept and the other submitted
+class CancellationToken
+{
+public:
+    CancellationToken(): flag(std::make_shared<std::atomic<bool> >(false))
+    {
+    }
+
+    void cancel()
+    {
+        *flag = true;
+    }
+
+    bool cancelled() const
+    {
+        return *flag;
+    }
+
+private:
+    std::shared_ptr<std::atomic<bool> > flag;
+};
+
+// Runs convolutions on threads of its own, so the callers do not block on them
+// At most `workers` requests run at once and `pending` wait; submitting more
+// than that blocks until there is room
+// Images of up to batchPixels pixels are coalesced: the worker that takes one
+// also takes the small ones waiting behind it, up to batchPixels in total,
+// and those of the same size and filter share a ConvolutionPlan, on its
+// thread. Larger images go through convolution(), which spreads each of them
+// over the cores; up to `workers` of them can run at once
+// Requests cancelled before they run are dropped; the ones already running
+// finish, but their result is dropped too
+class ConvolutionExecutor
+{
+public:
+    // Called on a worker with the output, or with what went wrong (then the
+    // image is empty). What it throws is dropped
+    typedef std::function<void(Image&&, std::exception_ptr)> Callback;
+
+    ConvolutionExecutor(size_t workers, size_t pending, size_t batchPixels = 256 * 256);
+    // Drops the requests still waiting, and waits for the running ones
+    ~ConvolutionExecutor();
+
+    // in is copied, unless moved in: then a view stays a view, and the storage
+    // it is on must outlive the request. The filter is copied
+    std::future<Image> submit(Image in, const Filter &filter, BorderMode border = BorderWrap,
+                              const CancellationToken &token = CancellationToken());
+    void submit(Image in, const Filter &filter, BorderMode border, Callback done,
+                const CancellationToken &token = CancellationToken());
+
+private:
+    struct State;
+    std::unique_ptr<State> state;
+
+    ConvolutionExecutor(const ConvolutionExecutor&);
+    ConvolutionExecutor& operator = (const ConvolutionExecutor&);
+};
+
+// Same as ConvolutionExecutor::submit, on an executor shared by the process:
+// CONVOLUTION_ASYNC_WORKERS workers if set, one per core otherwise, and four
+// pending requests per worker
+std::future<Image> convolveAsync(Image in, const Filter &filter, BorderMode border = BorderWrap,
+                                 const CancellationToken &token = CancellationToken());
+void convolveAsync(Image in, const Filter &filter, BorderMode border, ConvolutionExecutor::Callback done,
+                   const CancellationToken &token = CancellationToken());
+
+// True if the path names a raw image (.raw)
+bool isRawImage(const std::string&);
+
+// Raw image file: a header followed by the rows of Pixels exactly as they
+// are laid out in memory, so it can be mapped and used without decoding
+class RawImageFile
+{
+public:
+    // Maps an existing file
+    // Changes through the view are not written back
+    explicit RawImageFile(const std::string &path);
+
+    // Creates (or truncates) a file for an image of the given size and maps it
+    // Whatever is written through the view ends up in the file
+    RawImageFile(const std::string &path, size_t width, size_t height);
+
+    ~RawImageFile();
+
+    // View on the mapped pixels, valid while this object lives
+    Image view() const;
+
+private:
+    void *address;
+    size_t length;
+
+    RawImageFile(const RawImageFile&);
+    RawImageFile& operator = (const RawImageFile&);
+};
+
+// Binary PPM (P6) or PAM (P7, RGB or RGB_ALPHA) file, read a row at a time
+// so images that do not fit in memory can be processed in strips
+class RowReader
+{
+public:
+    size_t width, height;
+
+    explicit RowReader(const std::string &path);
+    ~RowReader();
+
+    // Rows can be read in any order, consecutive ones avoid seeking
+    void readRow(size_t y, Pixel *row);
+
+private:
+    FILE *fd;
+    size_t channels, next;
+    off_t dataOffset;
+    std::vector<uint8_t> buffer;
+
+    RowReader(const RowReader&);
+    RowReader& operator = (const RowReader&);
+};
+
+// Writes a PAM file if the path ends in .pam, binary PPM otherwise,
+// one row at a time from top to bottom
+class RowWriter
+{
+public:
+    RowWriter(const std::string &path, size_t width, size_t height);
+    ~RowWriter();
+
+    void writeRow(const Pixel *row);
+
+private:
+    size_t width, channels;
+    FILE *fd;
+    std::vector<uint8_t> buffer;
+
+    RowWriter(const RowWriter&);
+    RowWriter& operator = (const RowWriter&);
+};
+
+// Loads into strip the source rows the output rows [y0, y0 + n) need:
+// n + filter.height - 1 of them, with the vertical border already applied
+// Row filter.height / 2 of the strip is the output row y0
+void readStrip(Image *strip, RowReader &reader, size_t y0, size_t n,
+               const Filter &filter, BorderMode border);
 
 #endif // _BOOTSTRAP_H_
@@ -15,5 +15,38 @@ void initFilterFromFile(Filter *filter, const std::string &path)
 
     for (size_t y = 0; y < h; ++y)
         for (size_t x = 0; x < w; ++x)
-            in >> filter->values[y][x];
+            in >> (*filter)[y][x];
+
+    filter->plan();
+}
+
+
+void initFiltersFromFiles(std::vector<Filter> *filters, const std::string &paths)
+{
+    filters->clear();
+
+    size_t begin = 0;
+    while (begin <= paths.size()) {
+        size_t end = paths.find(',', begin);
+        if (end == std::string::npos)
+            end = paths.size();
+
+        filters->push_back(Filter());
+        initFilterFromFile(&filters->back(), paths.substr(begin, end - begin));
+        begin = end + 1;
+    }
+}
+
+
+BorderMode parseBorderMode(const std::string &name)
+{
+    if (name == "wrap")
+        return BorderWrap;
+    if (name == "clamp")
+        return BorderClamp;
+    if (name == "mirror")
+        return BorderMirror;
+    if (name == "zero")
+        return BorderZero;
+    throw std::runtime_error("Unknown border mode " + name);
 }
@@ -1,11 +1,44 @@
+#include <algorithm>
+#include <limits>
 #include <Magick++.h>
 #include <stdexcept>
 #include "bootstrap.h"
 
 
+// Quantum levels of the Magick build (8 or 16 bits) to a channel, and back
+// Integer channels take their whole range, float ones go from 0 to 1
+// When the depths match, the values are kept as they are
+template <class T>
+static T fromQuantum(Magick::Quantum q)
+{
+    return static_cast<T>(q * (static_cast<double>(std::numeric_limits<T>::max()) / MaxRGB) + 0.5);
+}
 
-void initImageFromFile(Image *img, const std::string &path)
+template <>
+float fromQuantum<float>(Magick::Quantum q)
+{
+    return static_cast<float>(q / static_cast<double>(MaxRGB));
+}
+
+template <class T>
+static Magick::Quantum toQuantum(T v)
+{
+    return static_cast<Magick::Quantum>(v * (MaxRGB / static_cast<double>(std::numeric_limits<T>::max())) + 0.5);
+}
+
+template <>
+Magick::Quantum toQuantum<float>(float v)
+{
+    return static_cast<Magick::Quantum>(std::min(std::max(v, 0.0f), 1.0f) * MaxRGB + 0.5);
+}
+
+
+// Straight from the pixel cache, at the depth of the build
+template <class P>
+static void readPixels(Matrix<P> *img, const std::string &path)
 {
+    typedef typename P::Channel Channel;
+
     Magick::Image mi;
     mi.read(path);
 
@@ -15,33 +48,142 @@ void initImageFromFile(Image *img, const std::string &path)
     Magick::PixelPacket *pixels = mi.getPixels(0, 0, img->width, img->height);
 
     for (size_t y = 0; y < img->height; ++y) {
-        for (size_t x = 0; x < img->width; ++x) {
-            Magick::PixelPacket *pixel = pixels + y * img->width + x;
-            img->values[y][x].r = pixel->red;
-            img->values[y][x].g = pixel->green;
-            img->values[y][x].b = pixel->blue;
-            img->values[y][x].a = pixel->opacity;
+        Magick::PixelPacket *pixel = pixels + y * img->width;
+        P *row = img->row(y);
+
+        for (size_t x = 0; x < img->width; ++x, ++pixel) {
+            row[x].r = fromQuantum<Channel>(pixel->red);
+            row[x].g = fromQuantum<Channel>(pixel->green);
+            row[x].b = fromQuantum<Channel>(pixel->blue);
+            row[x].a = fromQuantum<Channel>(pixel->opacity);
+        }
+    }
+}
+
+
+// depth is that of the file, 0 for the default of its format
+template <class P>
+static void writePixels(const Matrix<P> &img, const std::string &path, unsigned depth)
+{
+    Magick::Geometry size(img.width, img.height, 0, 0);
+    Magick::Image mi(size, Magick::Color(MaxRGB, MaxRGB, MaxRGB));
+
+    mi.modifyImage();
+    mi.type(Magick::TrueColorType);
+    if (depth)
+        mi.depth(depth);
+
+    Magick::PixelPacket *pixels = mi.getPixels(0, 0, img.width, img.height);
+
+    for (size_t y = 0; y < img.height; ++y) {
+        Magick::PixelPacket *pixel = pixels + y * img.width;
+        const P *row = img.row(y);
+
+        for (size_t x = 0; x < img.width; ++x, ++pixel) {
+            *pixel = Magick::Color(toQuantum(row[x].r), toQuantum(row[x].g), toQuantum(row[x].b),
+                                   toQuantum(row[x].a));
         }
     }
+
+    mi.syncPixels();
+    mi.write(path);
+}
+
+
+
+void initImageFromFile(Image *img, const std::string &path)
+{
+    readPixels(img, path);
+}
+
+
+void initImageFromFile(Image16 *img, const std::string &path)
+{
+    readPixels(img, path);
+}
+
+
+void initImageFromFile(ImageF *img, const std::string &path)
+{
+    readPixels(img, path);
 }
 
 
 
 void dumpImage(const Image &img, const std::string &path)
+{
+    writePixels(img, path, 0);
+}
+
+
+// Float channels have no file format of their own, they are written at 16 bits
+void dumpImage(const Image16 &img, const std::string &path)
+{
+    writePixels(img, path, 16);
+}
+
+
+void dumpImage(const ImageF &img, const std::string &path)
+{
+    writePixels(img, path, 16);
+}
+
+
+
+void initImageFromFile(PlanarImage *img, const std::string &path)
+{
+    Magick::Image mi;
+    mi.read(path);
+
+    Magick::Geometry size = mi.size();
+    const Magick::ImageType type = mi.type();
+    const bool gray = (type == Magick::BilevelType || type == Magick::GrayscaleType ||
+                       type == Magick::GrayscaleMatteType);
+    img->resize(size.width(), size.height(), gray ? 1 : 3, mi.matte());
+
+    Magick::PixelPacket *pixels = mi.getPixels(0, 0, img->width, img->height);
+
+    for (size_t y = 0; y < img->height; ++y) {
+        Magick::PixelPacket *pixel = pixels + y * img->width;
+
+        for (size_t x = 0; x < img->width; ++x, ++pixel) {
+            if (gray) {
+                img->colors[0][y][x] = fromQuantum<uint8_t>(pixel->red);
+            }
+            else {
+                img->colors[0][y][x] = fromQuantum<uint8_t>(pixel->red);
+                img->colors[1][y][x] = fromQuantum<uint8_t>(pixel->green);
+                img->colors[2][y][x] = fromQuantum<uint8_t>(pixel->blue);
+            }
+            if (!img->opaque())
+                img->opacity[y][x] = fromQuantum<uint8_t>(pixel->opacity);
+        }
+    }
+}
+
+
+
+void dumpImage(const PlanarImage &img, const std::string &path)
 {
     Magick::Geometry size(img.width, img.height, 0, 0);
-    Magick::Image mi(size, Magick::Color(255, 255, 255));
+    Magick::Image mi(size, Magick::Color(MaxRGB, MaxRGB, MaxRGB));
 
     mi.modifyImage();
-    mi.type(Magick::TrueColorType);
+    mi.type(img.gray() ? Magick::GrayscaleType : Magick::TrueColorType);
 
     Magick::PixelPacket *pixels = mi.getPixels(0, 0, img.width, img.height);
 
+    const Plane &red   = img.colors[0];
+    const Plane &green = img.colors[img.gray() ? 0 : 1];
+    const Plane &blue  = img.colors[img.gray() ? 0 : 2];
+
     for (size_t y = 0; y < img.height; ++y) {
-        for (size_t x = 0; x < img.width; ++x) {
-            Magick::PixelPacket *pixel = pixels + y * img.width + x;
-            *pixel = Magick::Color(img.values[y][x].r, img.values[y][x].g,
-                                   img.values[y][x].b, img.values[y][x].a);
+        Magick::PixelPacket *pixel = pixels + y * img.width;
+
+        for (size_t x = 0; x < img.width; ++x, ++pixel) {
+            uint8_t opacity = img.opaque() ? 0 : img.opacity[y][x];
+            *pixel = Magick::Color(toQuantum(red[y][x]), toQuantum(green[y][x]), toQuantum(blue[y][x]),
+                                   toQuantum(opacity));
         }
     }
 
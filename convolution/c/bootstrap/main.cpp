@@ -1,8 +1,11 @@
-#include <ctime>
+#include <algorithm>
+#include <cstdlib>
 #include <boost/timer.hpp>
 #include <fcntl.h>
 #include <iostream>
 #include <iomanip>
+#include <memory>
+#include <stdexcept>
 #include <Magick++.h>
 #include <unistd.h>
 #include "bootstrap.h"
@@ -12,17 +15,76 @@
 
 int usage(const char* bin)
 {
-    std::cerr << "Usage: " << bin << " [picture] [filter] [output bitmap]" << std::endl;
+    std::cerr << "Usage: " << bin << " [picture] [filter[,filter...]] [output bitmap] [border: wrap|clamp|mirror|zero]"
+              << " [precision: double|fixed] [layout: pixel|planar] [depth: 8|16|float]" << std::endl
+              << "       " << bin << " --gaussian [picture] [sigma] [output bitmap] [border]" << std::endl
+              << "       " << bin << " --batch [directory|list file] [filter] [output directory]"
+              << " [border] [workers]" << std::endl
+              << "Each stage is timed; CONVOLUTION_PROFILE=json reports them as a single JSON line, last"
+              << " on the output" << std::endl;
     return 1;
 }
 
 
-// elapsed in milliseconds
-static double getElapsed(struct timespec &end, struct timespec &start)
+// Bytes of the planes of an image
+static size_t planarBytes(const PlanarImage &image)
 {
-    double startns = start.tv_sec * 1000000000LL + start.tv_nsec;
-    double endns   = end.tv_sec * 1000000000LL + end.tv_nsec;
-    return (endns - startns) / 1000000;
+    return image.width * image.height * (image.colors.size() + !image.opaque());
+}
+
+
+// Wider channels, 16 bits or float
+// Several filters are applied one after the other, keeping the intermediate
+// images at that depth (unclamped, if float) instead of fusing them
+template <class P>
+static void convolveWide(const std::string &imagePath, const std::vector<Filter> &filters,
+                         const std::string &outputPath, BorderMode border, StageProfile &profile)
+{
+    Matrix<P> image, output;
+    profile.start("decode");
+    initImageFromFile(&image, imagePath);
+    const size_t bytes = image.width * image.height * sizeof(P);
+    profile.stop(bytes);
+
+    profile.start("allocate");
+    output.resize(image.width, image.height);
+    profile.stop(bytes);
+
+    profile.start("compute");
+    for (size_t i = 0; i < filters.size(); ++i) {
+        if (i > 0)
+            std::swap(image, output);
+        convolution(&output, image, filters[i], border);
+    }
+    profile.stop(bytes * filters.size());
+
+    profile.start("encode");
+    dumpImage(output, outputPath);
+    profile.stop(bytes);
+}
+
+
+// Planar layout, the image is split into planes when loaded
+static void convolvePlanar(const std::string &imagePath, const Filter &filter, const std::string &outputPath,
+                           BorderMode border, StageProfile &profile)
+{
+    PlanarImage image, output;
+    profile.start("decode");
+    initImageFromFile(&image, imagePath);
+    profile.stop(planarBytes(image));
+    std::cout << "Planes: " << image.colors.size() + !image.opaque() << std::endl;
+
+    profile.start("allocate");
+    output.resize(image.width, image.height, image.colors.size(), !image.opaque());
+    profile.stop(planarBytes(output));
+
+    profile.start("compute");
+    convolution(&output, image, filter, border);
+    profile.stop(planarBytes(image));
+
+    profile.start("encode");
+    dumpImage(output, outputPath);
+    profile.stop(planarBytes(output));
 }
 
 
@@ -32,45 +94,162 @@ int main(int argc, const char *argv[])
     if (argc < 4)
         return usage(argv[0]);
 
+    // Every stage is timed, and reported at the end
+    StageProfile profile;
+
     // This is required
+    profile.start("initialize");
     Magick::InitializeMagick(argv[0]);
+    profile.stop();
+
+    if (std::string(argv[1]) == "--batch") {
+        if (argc < 5)
+            return usage(argv[0]);
+        try {
+            Filter filter;
+            profile.start("filter");
+            initFilterFromFile(&filter, argv[3]);
+            profile.stop(filter.width * filter.height * sizeof(double));
+
+            profile.start("batch");
+            const int status = runBatch(argv[2], filter, argv[4], parseBorderMode((argc > 5) ? argv[5] : "wrap"),
+                                        (argc > 6) ? std::max(1l, atol(argv[6])) : 1);
+            profile.stop();
+            profile.report(std::cout);
+            return status;
+        }
+        catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return -1;
+        }
+    }
+
+    // The filter files are replaced by a Gaussian, approximated by boxes, or
+    // sampled for small sigmas
+    const bool gaussian = std::string(argv[1]) == "--gaussian";
+    if (gaussian) {
+        if (argc < 5)
+            return usage(argv[0]);
+        ++argv;
+        --argc;
+    }
 
     const char *imagePath  = argv[1];
     const char *filterPath = argv[2];
     const char *outputPath = argv[3];
+    const char *borderName = (argc > 4) ? argv[4] : "wrap";
+    const std::string precision = (argc > 5) ? argv[5] : "double";
+    const std::string layout = (argc > 6) ? argv[6] : "pixel";
+    const std::string depth = (argc > 7) ? argv[7] : "8";
 
     std::cout << "Image:  " << imagePath << std::endl
-              << "Filter: " << filterPath << std::endl;
+              << (gaussian ? "Sigma:  " : "Filter: ") << filterPath << std::endl
+              << "Border: " << borderName << std::endl;
 
     try {
-        // Load the filter
-        Filter filter;
-        initFilterFromFile(&filter, filterPath);
-        std::cout << std::fixed << filter << std::endl;
+        BorderMode border = parseBorderMode(borderName);
+
+        // Load the filters
+        // Several are applied one after the other, fused into a single pass
+        // Boxes of any size run at the same speed
+        std::vector<Filter> filters;
+        profile.start("filter");
+        if (gaussian) {
+            filters = gaussianBoxes(atof(filterPath));
+            std::cout << "Passes:";
+            for (size_t i = 0; i < filters.size(); ++i)
+                std::cout << " " << filters[i].width << "x" << filters[i].height;
+            std::cout << std::endl;
+        }
+        else {
+            initFiltersFromFiles(&filters, filterPath);
+            for (size_t i = 0; i < filters.size(); ++i)
+                std::cout << std::fixed << filters[i] << std::endl;
+        }
+
+        if (precision == "fixed") {
+            if (filters.size() != 1)
+                throw std::runtime_error("Fixed point is only supported for a single filter");
+            filters[0].quantize();
+            std::cout << "Fixed point: 16 bit coefficients, shift " << filters[0].fixed.shift
+                      << ", error bound " << filters[0].fixed.errorBound << " levels" << std::endl;
+        }
+        else if (precision != "double") {
+            throw std::runtime_error("Unknown precision " + precision);
+        }
+
+        size_t coefficients = 0;
+        for (size_t i = 0; i < filters.size(); ++i)
+            coefficients += filters[i].width * filters[i].height;
+        profile.stop(coefficients * sizeof(double));
+
+        if (depth != "8") {
+            if (precision != "double" || layout != "pixel" || isRawImage(imagePath) || isRawImage(outputPath))
+                throw std::runtime_error("Wider channels take double precision, the pixel layout, and no raw images");
+            if (depth == "16")
+                convolveWide<Pixel16>(imagePath, filters, outputPath, border, profile);
+            else if (depth == "float")
+                convolveWide<PixelF>(imagePath, filters, outputPath, border, profile);
+            else
+                throw std::runtime_error("Unknown depth " + depth);
+            profile.report(std::cout);
+            return 0;
+        }
+
+        if (layout == "planar") {
+            if (filters.size() != 1 || isRawImage(imagePath) || isRawImage(outputPath))
+                throw std::runtime_error("The planar layout takes a single filter, and no raw images");
+            convolvePlanar(imagePath, filters[0], outputPath, border, profile);
+            profile.report(std::cout);
+            return 0;
+        }
+        else if (layout != "pixel") {
+            throw std::runtime_error("Unknown layout " + layout);
+        }
 
         // Load the image
+        // Raw images are mapped instead, both for input and output
+        std::unique_ptr<RawImageFile> inputFile, outputFile;
         Image image;
-        initImageFromFile(&image, imagePath);
-
-        // Process
-        struct timespec start;
-        clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+        profile.start("decode");
+        if (isRawImage(imagePath)) {
+            inputFile.reset(new RawImageFile(imagePath));
+            image = inputFile->view();
+        }
+        else {
+            initImageFromFile(&image, imagePath);
+        }
+        const size_t bytes = image.width * image.height * sizeof(Pixel);
+        profile.stop(bytes);
 
+        // Sized here, so the convolution does not allocate it
         Image output;
-        convolution(&output, image, filter);
+        profile.start("allocate");
+        if (isRawImage(outputPath)) {
+            outputFile.reset(new RawImageFile(outputPath, image.width, image.height));
+            output = outputFile->view();
+        }
+        else {
+            output.resize(image.width, image.height);
+        }
+        profile.stop(bytes);
 
-        struct timespec end;
-        clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+        // Process
+        profile.start("compute");
+        if (filters.size() == 1)
+            convolution(&output, image, filters[0], border);
+        else
+            convolution(&output, image, FilterChain(filters, border));
+        profile.stop(bytes);
 
         // Dump
-        dumpImage(output, outputPath);
-
-        // Print time used
-        double elapsed = getElapsed(end, start);
-        std::cout << "Took " << elapsed << " milliseconds"
-                  << std::endl
-                  << "(" << elapsed / 1000 << " seconds)"
-                  << std::endl;
+        if (!outputFile) {
+            profile.start("encode");
+            dumpImage(output, outputPath);
+            profile.stop(bytes);
+        }
+
+        profile.report(std::cout);
     }
     catch (const std::exception& e) {
         std::cerr << e.what() << std::endl;
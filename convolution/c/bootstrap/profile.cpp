@@ -0,0 +1,101 @@
+#include <cstdlib>
+#include <ctime>
+#include <iomanip>
+#include <sys/resource.h>
+#include "bootstrap.h"
+
+
+// Milliseconds on the given clock
+static double now(clockid_t clock)
+{
+    struct timespec t;
+    clock_gettime(clock, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+
+StageProfile::StageProfile(): running(false), wallStart(0), cpuStart(0)
+{
+}
+
+
+void StageProfile::start(const std::string &stage)
+{
+    if (running)
+        stop();
+
+    Stage s;
+    s.name = stage;
+    s.wall = s.cpu = 0;
+    s.peakRss = 0;
+    s.bytes = 0;
+    stages.push_back(s);
+
+    running = true;
+    wallStart = now(CLOCK_MONOTONIC_RAW);
+    // All threads of the process
+    cpuStart = now(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+
+void StageProfile::stop(size_t bytes)
+{
+    if (!running)
+        return;
+
+    Stage &s = stages.back();
+    s.wall = now(CLOCK_MONOTONIC_RAW) - wallStart;
+    s.cpu = now(CLOCK_PROCESS_CPUTIME_ID) - cpuStart;
+    s.bytes = bytes;
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        s.peakRss = usage.ru_maxrss;
+
+    running = false;
+}
+
+
+void StageProfile::report(std::ostream &out) const
+{
+    const char *format = getenv("CONVOLUTION_PROFILE");
+    double wall = 0, cpu = 0;
+    for (size_t i = 0; i < stages.size(); ++i) {
+        wall += stages[i].wall;
+        cpu += stages[i].cpu;
+    }
+    const long peakRss = stages.empty() ? 0 : stages.back().peakRss;
+
+    const std::ios::fmtflags flags = out.flags();
+    const std::streamsize precision = out.precision();
+    out << std::fixed << std::setprecision(3);
+
+    // Names are ours, so they need no escaping
+    if (format && std::string(format) == "json") {
+        out << "{\"stages\":[";
+        for (size_t i = 0; i < stages.size(); ++i) {
+            const Stage &s = stages[i];
+            out << (i ? "," : "") << "{\"name\":\"" << s.name << "\",\"wall_ms\":" << s.wall
+                << ",\"cpu_ms\":" << s.cpu << ",\"peak_rss_kb\":" << s.peakRss << ",\"bytes\":" << s.bytes << "}";
+        }
+        out << "],\"wall_ms\":" << wall << ",\"cpu_ms\":" << cpu << ",\"peak_rss_kb\":" << peakRss << "}"
+            << std::endl;
+    }
+    else {
+        out << std::left << std::setw(12) << "Stage" << std::right << std::setw(12) << "wall ms"
+            << std::setw(12) << "cpu ms" << std::setw(14) << "peak RSS MB" << std::setw(14) << "MB"
+            << std::setw(12) << "MB/s" << std::endl;
+        for (size_t i = 0; i < stages.size(); ++i) {
+            const Stage &s = stages[i];
+            out << std::left << std::setw(12) << s.name << std::right << std::setw(12) << s.wall
+                << std::setw(12) << s.cpu << std::setw(14) << s.peakRss * 1024 / megabyte
+                << std::setw(14) << s.bytes / megabyte << std::setw(12)
+                << ((s.bytes && s.wall > 0) ? s.bytes / megabyte * 1e3 / s.wall : 0) << std::endl;
+        }
+        out << std::left << std::setw(12) << "Total" << std::right << std::setw(12) << wall
+            << std::setw(12) << cpu << std::setw(14) << peakRss * 1024 / megabyte << std::endl;
+    }
+
+    out.flags(flags);
+    out.precision(precision);
+}
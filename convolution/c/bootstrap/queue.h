@@ -0,0 +1,76 @@
+#ifndef _QUEUE_H_
+#define _QUEUE_H_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+// Queue between pipeline stages
+// Producers block when it is full, so a fast stage can not get too far
+// ahead of a slow one
+template <class T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity): capacity(capacity), closed(false)
+    {
+    }
+
+    // Blocks while the queue is full
+    // Returns false, dropping the item, if the queue has been closed
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+        if (closed)
+            return false;
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    // Blocks while the queue is empty
+    // Returns false once the queue has been closed and drained
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+        if (items.empty())
+            return false;
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    // Same as pop, without blocking
+    // Returns false if the queue is empty
+    bool tryPop(T &item)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (items.empty())
+            return false;
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    // No more items will be pushed
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    bool closed;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable notFull, notEmpty;
+};
+
+#endif // _QUEUE_H_
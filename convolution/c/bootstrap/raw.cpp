@@ -0,0 +1,121 @@
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bootstrap.h"
+
+
+// Layout of the header
+// The pixels start right after it, so they keep the alignment of the mapping
+struct RawHeader
+{
+    char     magic[8];      // RAW_MAGIC
+    char     layout[4];     // Channel order of each pixel, RAW_LAYOUT
+    uint32_t headerSize;    // sizeof(RawHeader)
+    uint64_t width, height;
+    uint64_t stride;        // Bytes per row
+    uint8_t  reserved[MATRIX_ALIGNMENT - 40];
+};
+
+static_assert(sizeof(RawHeader) == MATRIX_ALIGNMENT, "The pixels must stay aligned");
+
+#define RAW_MAGIC  "CONVRAW1"
+// Pixel as declared in convolution.h: red, green, blue and opacity, 8 bits each
+#define RAW_LAYOUT "RGBO"
+
+
+static std::runtime_error systemError(const std::string &what, const std::string &path)
+{
+    return std::runtime_error(what + " " + path + ": " + strerror(errno));
+}
+
+
+bool isRawImage(const std::string &path)
+{
+    return path.size() > 4 && path.compare(path.size() - 4, 4, ".raw") == 0;
+}
+
+
+RawImageFile::RawImageFile(const std::string &path): address(MAP_FAILED), length(0)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw systemError("Could not open", path);
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        throw systemError("Could not stat", path);
+    }
+    length = st.st_size;
+
+    // Private and writable, so the view can be handed to code expecting a
+    // mutable Image, but nothing goes back to the file
+    if (length >= sizeof(RawHeader))
+        address = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED)
+        throw systemError("Could not map", path);
+
+    const RawHeader *header = static_cast<const RawHeader*>(address);
+    if (memcmp(header->magic, RAW_MAGIC, sizeof(header->magic)) != 0 ||
+        header->headerSize != sizeof(RawHeader)) {
+        munmap(address, length);
+        throw std::runtime_error("Not a raw image: " + path);
+    }
+    if (memcmp(header->layout, RAW_LAYOUT, sizeof(header->layout)) != 0 ||
+        header->stride % sizeof(Pixel) != 0 || header->stride < header->width * sizeof(Pixel) ||
+        length < sizeof(RawHeader) + header->stride * header->height) {
+        munmap(address, length);
+        throw std::runtime_error("Unsupported or truncated raw image: " + path);
+    }
+
+    // Sequential access is the common case, let the kernel read ahead
+    madvise(address, length, MADV_SEQUENTIAL);
+}
+
+
+RawImageFile::RawImageFile(const std::string &path, size_t width, size_t height):
+    address(MAP_FAILED), length(0)
+{
+    const size_t stride = Image::alignedStride(width) * sizeof(Pixel);
+    length = sizeof(RawHeader) + stride * height;
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throw systemError("Could not create", path);
+    if (ftruncate(fd, length) < 0) {
+        close(fd);
+        throw systemError("Could not resize", path);
+    }
+
+    address = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED)
+        throw systemError("Could not map", path);
+
+    RawHeader *header = static_cast<RawHeader*>(address);
+    memcpy(header->magic, RAW_MAGIC, sizeof(header->magic));
+    memcpy(header->layout, RAW_LAYOUT, sizeof(header->layout));
+    header->headerSize = sizeof(RawHeader);
+    header->width  = width;
+    header->height = height;
+    header->stride = stride;
+}
+
+
+RawImageFile::~RawImageFile()
+{
+    munmap(address, length);
+}
+
+
+Image RawImageFile::view() const
+{
+    const RawHeader *header = static_cast<const RawHeader*>(address);
+    Pixel *pixels = reinterpret_cast<Pixel*>(static_cast<char*>(address) + sizeof(RawHeader));
+    return Image(pixels, header->width, header->height, header->stride / sizeof(Pixel));
+}
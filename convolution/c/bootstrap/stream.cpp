@@ -0,0 +1,157 @@
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+#include "bootstrap.h"
+#include "../kernels/kernels.h"
+
+
+// Reads the next whitespace separated token of a netpbm header, skipping comments
+static std::string headerToken(FILE *fd)
+{
+    std::string token;
+    int c;
+
+    while ((c = fgetc(fd)) != EOF) {
+        if (c == '#') {
+            while ((c = fgetc(fd)) != EOF && c != '\n');
+        }
+        else if (isspace(c)) {
+            if (!token.empty())
+                break;
+        }
+        else {
+            token += static_cast<char>(c);
+        }
+    }
+    return token;
+}
+
+
+RowReader::RowReader(const std::string &path): width(0), height(0), fd(NULL), next(0)
+{
+    fd = fopen(path.c_str(), "rb");
+    if (!fd)
+        throw std::runtime_error("Could not open " + path);
+
+    std::string magic = headerToken(fd);
+    size_t maxval = 0;
+
+    if (magic == "P6") {
+        width    = std::stoul(headerToken(fd));
+        height   = std::stoul(headerToken(fd));
+        maxval   = std::stoul(headerToken(fd));
+        channels = 3;
+    }
+    else if (magic == "P7") {
+        channels = 0;
+        for (std::string key = headerToken(fd); key != "ENDHDR"; key = headerToken(fd)) {
+            if (key.empty())
+                throw std::runtime_error("Truncated PAM header in " + path);
+            else if (key == "WIDTH")
+                width = std::stoul(headerToken(fd));
+            else if (key == "HEIGHT")
+                height = std::stoul(headerToken(fd));
+            else if (key == "DEPTH")
+                channels = std::stoul(headerToken(fd));
+            else if (key == "MAXVAL")
+                maxval = std::stoul(headerToken(fd));
+            else if (key == "TUPLTYPE")
+                headerToken(fd);
+        }
+        if (channels != 3 && channels != 4)
+            throw std::runtime_error("Only RGB and RGB_ALPHA PAM files are supported: " + path);
+    }
+    else {
+        throw std::runtime_error("Not a binary PPM or PAM file: " + path);
+    }
+
+    if (maxval != 255)
+        throw std::runtime_error("Only 8 bits per channel are supported: " + path);
+
+    dataOffset = ftello(fd);
+    buffer.resize(width * channels);
+}
+
+
+RowReader::~RowReader()
+{
+    fclose(fd);
+}
+
+
+void RowReader::readRow(size_t y, Pixel *row)
+{
+    if (y != next && fseeko(fd, dataOffset + static_cast<off_t>(y * buffer.size()), SEEK_SET) != 0)
+        throw std::runtime_error("Could not seek to row " + std::to_string(y));
+    if (fread(buffer.data(), 1, buffer.size(), fd) != buffer.size())
+        throw std::runtime_error("Could not read row " + std::to_string(y));
+    next = y + 1;
+
+    // Pixel::a is an opacity, as in Magick
+    const uint8_t *src = buffer.data();
+    for (size_t x = 0; x < width; ++x, src += channels) {
+        row[x].r = src[0];
+        row[x].g = src[1];
+        row[x].b = src[2];
+        row[x].a = (channels == 4) ? 255 - src[3] : 0;
+    }
+}
+
+
+RowWriter::RowWriter(const std::string &path, size_t width, size_t height): width(width), fd(NULL)
+{
+    fd = fopen(path.c_str(), "wb");
+    if (!fd)
+        throw std::runtime_error("Could not open " + path);
+
+    // PAM keeps the alpha, anything else is written as PPM
+    bool pam = path.size() > 4 && path.compare(path.size() - 4, 4, ".pam") == 0;
+    if (pam) {
+        channels = 4;
+        fprintf(fd, "P7\nWIDTH %zu\nHEIGHT %zu\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n",
+                width, height);
+    }
+    else {
+        channels = 3;
+        fprintf(fd, "P6\n%zu %zu\n255\n", width, height);
+    }
+    buffer.resize(width * channels);
+}
+
+
+RowWriter::~RowWriter()
+{
+    fclose(fd);
+}
+
+
+void RowWriter::writeRow(const Pixel *row)
+{
+    uint8_t *dst = buffer.data();
+    for (size_t x = 0; x < width; ++x, dst += channels) {
+        dst[0] = row[x].r;
+        dst[1] = row[x].g;
+        dst[2] = row[x].b;
+        if (channels == 4)
+            dst[3] = 255 - row[x].a;
+    }
+
+    if (fwrite(buffer.data(), 1, buffer.size(), fd) != buffer.size())
+        throw std::runtime_error("Could not write a row");
+}
+
+
+void readStrip(Image *strip, RowReader &reader, size_t y0, size_t n,
+               const Filter &filter, BorderMode border)
+{
+    const ptrdiff_t half = filter.height / 2;
+
+    strip->resize(reader.width, n + filter.height - 1);
+    for (size_t i = 0; i < strip->height; ++i) {
+        ptrdiff_t imageY = borderIndex(static_cast<ptrdiff_t>(y0 + i) - half, reader.height, border);
+        if (imageY >= 0)
+            reader.readRow(imageY, strip->row(i));
+        else
+            std::fill(strip->row(i), strip->row(i) + strip->width, Pixel());
+    }
+}
@@ -0,0 +1,49 @@
+#include <iostream>
+#include <Magick++.h>
+#include "../bootstrap/bootstrap.h"
+
+
+int usage(const char* bin)
+{
+    std::cerr << "Usage: " << bin << " [input] [output]" << std::endl
+              << "One of them must be a raw image (.raw), the other any format Magick supports" << std::endl;
+    return 1;
+}
+
+
+// Converts between raw images and anything Magick can read or write, so
+// the convolution tools can skip decoding on repeated runs
+int main(int argc, const char *argv[])
+{
+    if (argc < 3)
+        return usage(argv[0]);
+
+    Magick::InitializeMagick(argv[0]);
+
+    const char *inputPath  = argv[1];
+    const char *outputPath = argv[2];
+
+    try {
+        if (isRawImage(inputPath) && !isRawImage(outputPath)) {
+            RawImageFile input(inputPath);
+            dumpImage(input.view(), outputPath);
+        }
+        else if (!isRawImage(inputPath) && isRawImage(outputPath)) {
+            Image image;
+            initImageFromFile(&image, inputPath);
+
+            RawImageFile output(outputPath, image.width, image.height);
+            Image view = output.view();
+            view = image;
+        }
+        else {
+            return usage(argv[0]);
+        }
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
@@ -1,42 +1,68 @@
 #ifndef _CONVOLUTION_H_
 #define _CONVOLUTION_H_
 
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
+#include <memory>
+#include <new>
+#include <stdexcept>
 #include <stdint.h>
+#include <vector>
+
+// Alignment, in bytes, of the matrix storage and of each row
+#define MATRIX_ALIGNMENT 64
 
 // Matrix representation
+// All rows live in one aligned buffer, each one padded up to `stride` elements
+// so every row starts on a MATRIX_ALIGNMENT boundary
+// A matrix can also be a view on storage owned by someone else
 template <class T>
 class Matrix
 {
 public:
     // Internal representation
-    size_t   width, height;
-    T **values;
+    size_t   width, height, stride;
+    T *values;
 
     // Default constructor
-    Matrix(): width(0), height(0), values(NULL)
+    Matrix(): width(0), height(0), stride(0), values(NULL), _owner(true)
     {
     };
 
     // Initializes the matrix from the given width and height
-    Matrix(size_t w, size_t h): width(w), height(h), values(NULL)
+    Matrix(size_t w, size_t h): width(w), height(h), stride(0), values(NULL), _owner(true)
     {
         _allocate();
     }
 
     // Initializes a square matrix
-    explicit Matrix(size_t s): width(s), height(s), values(NULL)
+    explicit Matrix(size_t s): width(s), height(s), stride(0), values(NULL), _owner(true)
     {
         _allocate();
     }
 
+    // View on existing storage, stride given in elements
+    // The storage must outlive the view
+    Matrix(T *v, size_t w, size_t h, size_t s): width(w), height(h), stride(s), values(v), _owner(false)
+    {
+    }
+
     // Copy constructor
-    Matrix(const Matrix<T> &src): width(src.width), height(src.height), values(NULL)
+    // Copying a view copies the pixels, the copy owns them
+    Matrix(const Matrix<T> &src): width(src.width), height(src.height), stride(0), values(NULL), _owner(true)
     {
         _allocate();
         _copy(src);
     }
 
+    // Move constructor
+    Matrix(Matrix<T> &&src) noexcept: width(src.width), height(src.height), stride(src.stride), values(src.values),
+        _owner(src._owner)
+    {
+        src._release();
+    }
+
     // Destructor
     ~Matrix()
     {
@@ -46,45 +72,140 @@ public:
     // Assign
     Matrix<T>& operator = (const Matrix<T> &src)
     {
+        if (this == &src)
+            return *this;
+        if (width != src.width || height != src.height)
+            resize(src.width, src.height);
+        _copy(src);
+        return *this;
+    }
+
+    // Move assign
+    Matrix<T>& operator = (Matrix<T> &&src) noexcept
+    {
+        if (this == &src)
+            return *this;
         _free();
         width  = src.width;
         height = src.height;
-        _allocate();
-        _copy(src);
+        stride = src.stride;
+        values = src.values;
+        _owner = src._owner;
+        src._release();
         return *this;
     }
 
     // Resize
+    // Keeps the storage if the size does not change, so resizing a view to
+    // its own size leaves it a view
     void resize(size_t w, size_t h)
     {
+        if (values && w == width && h == height)
+            return;
         _free();
         width  = w;
         height = h;
         _allocate();
     }
 
+    // Same as resize, but new storage is left uninitialized: the caller
+    // writes every element before reading it (plain types only). Its pages
+    // then end up on the NUMA node of the thread that writes them first
+    void resizeUninitialized(size_t w, size_t h)
+    {
+        if (values && w == width && h == height)
+            return;
+        _free();
+        width  = w;
+        height = h;
+        _allocate(false);
+    }
+
+    // Row accessors
+    T* row(size_t y)
+    {
+        return values + y * stride;
+    }
+
+    const T* row(size_t y) const
+    {
+        return values + y * stride;
+    }
+
+    T* operator [] (size_t y)
+    {
+        return row(y);
+    }
+
+    const T* operator [] (size_t y) const
+    {
+        return row(y);
+    }
+
+    // Number of elements per row, so rows stay aligned when possible
+    static size_t alignedStride(size_t w)
+    {
+        if (MATRIX_ALIGNMENT % sizeof(T) != 0)
+            return w;
+        size_t perLine = MATRIX_ALIGNMENT / sizeof(T);
+        return (w + perLine - 1) / perLine * perLine;
+    }
+
+    // View on the w x h block starting at column x, row y, sharing the
+    // storage and the stride, so nothing is copied
+    Matrix<T> view(size_t x, size_t y, size_t w, size_t h)
+    {
+        if (x + w > width || y + h > height)
+            throw std::out_of_range("View out of the matrix");
+        return Matrix<T>(values + y * stride + x, w, h, stride);
+    }
+
+    // True unless this is a view
+    bool owner() const
+    {
+        return _owner;
+    }
+
 protected:
-    void _allocate(void)
+    bool _owner;
+
+    void _allocate(bool initialize = true)
     {
-        values = new T*[height];
-        for (size_t y = 0; y < height; ++y)
-            values[y] = new T[width];
+        stride = alignedStride(width);
+        if (stride * height == 0) {
+            values = NULL;
+            return;
+        }
+
+        void *buffer = NULL;
+        if (posix_memalign(&buffer, MATRIX_ALIGNMENT, stride * height * sizeof(T)) != 0)
+            throw std::bad_alloc();
+        values = static_cast<T*>(buffer);
+        if (initialize)
+            std::uninitialized_fill_n(values, stride * height, T());
     }
 
     void _copy(const Matrix<T>& src)
     {
         for (size_t y = 0; y < height; ++y)
-            for (size_t x = 0; x < width; ++x)
-                values[y][x] = src.values[y][x];
+            std::copy(src.row(y), src.row(y) + width, row(y));
     }
 
     void _free()
     {
-        for (size_t y = 0; y < height; ++y)
-            delete [] values[y];
-        delete [] values;
+        if (values && _owner) {
+            for (size_t i = 0; i < stride * height; ++i)
+                values[i].~T();
+            free(values);
+        }
+        _release();
+    }
+
+    void _release()
+    {
         values = NULL;
-        width = height = 0;
+        width = height = stride = 0;
+        _owner = true;
     }
 };
 
@@ -94,25 +215,220 @@ std::ostream& operator << (std::ostream &out, const Matrix<T> &m)
 {
     for (size_t y = 0; y < m.height; ++y) {
         for (size_t x = 0; x < m.width; ++x)
-            out << m.values[y][x] << " ";
+            out << m[y][x] << " ";
         out << std::endl;
     }
     return out;
 }
 
-// Pixel
-struct Pixel
+// Pixel, of uint8_t, uint16_t or float channels
+// Integer channels go from 0 to their largest value, and results are clamped
+// to that range. Float ones go from 0 to 1 and are never clamped, so
+// intermediate results keep what falls outside
+template <class T>
+struct BasicPixel
+{
+    typedef T Channel;
+    T r, g, b, a;
+
+    BasicPixel(): r(0), g(0), b(0), a(1) {};
+};
+
+typedef BasicPixel<uint8_t>  Pixel;
+typedef BasicPixel<uint16_t> Pixel16;
+typedef BasicPixel<float>    PixelF;
+
+// One term of a separable decomposition
+// The filter is the sum of the outer products column * row of all its terms
+struct FilterTerm
+{
+    std::vector<double> column, row;
+};
+
+// Non zero coefficient of a filter, at column dx and row dy
+struct FilterTap
+{
+    size_t dx, dy;
+    double weight;
+};
+
+// Coefficients quantized to 16 bit fixed point, each one standing for
+// coefficient / 2^shift, to be accumulated on 32 bit integers
+struct FixedPointFilter
 {
-    uint8_t r, g, b, a;
+    std::vector<int16_t> coefficients;  // Row major, as the filter
+    unsigned shift;
+    // Largest difference, in pixel levels, with the double precision sum
+    // before it is truncated
+    double errorBound;
 
-    Pixel(): r(0), g(0), b(0), a(1) {};
+    FixedPointFilter(): shift(0), errorBound(0) {};
+};
+
+// Filter
+class Filter: public Matrix<double>
+{
+public:
+    // Separable decomposition, empty if the filter is better applied directly
+    std::vector<FilterTerm> terms;
+    // Non zero coefficients, empty unless the filter is sparse enough to be
+    // applied tap by tap
+    std::vector<FilterTap> taps;
+    // Fixed point coefficients, empty unless quantize was called
+    FixedPointFilter fixed;
+    // Every coefficient is the same: a box, which the backends apply with
+    // running sums at a cost per pixel that does not depend on its size
+    bool box;
+
+    Filter(): box(false)
+    {
+    };
+
+    Filter(size_t w, size_t h): Matrix<double>(w, h), box(false)
+    {
+    }
+
+    explicit Filter(size_t s): Matrix<double>(s), box(false)
+    {
+    }
+
+    // Analyzes the coefficients and decides how the filter is to be applied
+    // Must be called again if the coefficients change
+    void plan();
+
+    // Switches to the fixed point coefficients, applied by the dense or the
+    // sparse kernel. To be called after plan
+    void quantize();
 };
 
 // Typedefs
-typedef Matrix<double> Filter;
 typedef Matrix<Pixel> Image;
+typedef Matrix<Pixel16> Image16;
+typedef Matrix<PixelF> ImageF;
+typedef Matrix<uint8_t> Plane;
+
+// Image kept as one contiguous plane per channel: the color ones (a single
+// gray plane, or red, green and blue) and the opacity, unless it is opaque
+class PlanarImage
+{
+public:
+    size_t width, height;
+    std::vector<Plane> colors;
+    Plane opacity;
+
+    PlanarImage(): width(0), height(0)
+    {
+    }
+
+    // Allocates nColors color planes, and the opacity one if withOpacity
+    void resize(size_t w, size_t h, size_t nColors, bool withOpacity)
+    {
+        width  = w;
+        height = h;
+        colors.resize(nColors);
+        for (size_t c = 0; c < nColors; ++c)
+            colors[c].resize(w, h);
+        if (withOpacity)
+            opacity.resize(w, h);
+        else
+            opacity = Plane();
+    }
+
+    bool gray() const
+    {
+        return colors.size() == 1;
+    }
+
+    bool opaque() const
+    {
+        return opacity.values == NULL;
+    }
+};
+
+// How the pixels outside of the image are taken
+enum BorderMode
+{
+    BorderWrap,     // Periodic, from the opposite side
+    BorderClamp,    // Repeats the pixel on the edge
+    BorderMirror,   // Reflects around the pixel on the edge
+    BorderZero      // All zero
+};
+
+// Rectangle of an image
+struct Region
+{
+    size_t x, y, width, height;
+};
+
+// Filters applied one after the other in a single pass over the image
+// Intermediate results are kept in full precision, neither clamped nor
+// truncated, so the chain is linear
+class FilterChain
+{
+public:
+    std::vector<Filter> stages;
+    BorderMode border;
+
+    // With periodic borders the stages compose exactly into one filter,
+    // which is then used instead of the stages
+    bool folded;
+    Filter combined;
+
+    // Every stage is a box: the chain is applied as running sums instead,
+    // which beats folding
+    bool boxes;
+
+    FilterChain(const std::vector<Filter> &stages, BorderMode border);
+};
+
+// Everything the convolution with a filter works out before it gets to the
+// pixels, done once for an image size: which kernel applies it, the border
+// tables, the transform of the filter and the scratch buffers. After that
+// execute allocates nothing, unless out has to be resized
+// The filter must have been planned (and quantized, if wanted). execute
+// runs on the calling thread, several threads need a plan each
+class ConvolutionPlan
+{
+public:
+    ConvolutionPlan(const Filter &filter, size_t width, size_t height, BorderMode border = BorderWrap);
+    ~ConvolutionPlan();
+
+    // Throws if in is not of the size of the plan
+    void execute(Image *out, const Image &in);
+
+private:
+    struct State;
+    std::unique_ptr<State> state;
+
+    ConvolutionPlan(const ConvolutionPlan&);
+    ConvolutionPlan& operator = (const ConvolutionPlan&);
+};
+
+// Three boxes that applied one after the other approximate a Gaussian
+// with the given standard deviation. Below a sigma of 1.5 the boxes would be
+// 1 wide, so it is a single sampled Gaussian, 6 sigma + 1 wide, instead
+std::vector<Filter> gaussianBoxes(double sigma);
 
 // Filter
-void convolution(Image *out, const Image &in, const Filter &filter);
+void convolution(Image *out, const Image &in, const Filter &filter, BorderMode border = BorderWrap);
+void convolution(Image *out, const Image &in, const FilterChain &chain);
+// Each color plane on its own, the opacity is copied
+void convolution(PlanarImage *out, const PlanarImage &in, const Filter &filter, BorderMode border = BorderWrap);
+// Same, at 16 bits or in floating point per channel. Box and large filters
+// take the spatial kernels there
+void convolution(Image16 *out, const Image16 &in, const Filter &filter, BorderMode border = BorderWrap);
+void convolution(ImageF *out, const ImageF &in, const Filter &filter, BorderMode border = BorderWrap);
+// Only the given regions of out, the rest is left as it was. out is resized
+// to the size of in if it is not already, and the pixels around each region
+// are read from in, as for the whole image. out can be a view of the size of
+// in, the region coordinates are the same in both
+// Throws if a region does not fit in the image, or if out is a view of
+// another size
+void convolution(Image *out, const Image &in, const Filter &filter, const std::vector<Region> &regions,
+                 BorderMode border = BorderWrap);
+
+// Applies the filter n times, in place, between image and one more buffer
+// Small filters are applied several times to a band while it is in cache
+void convolveIterate(Image &image, const Filter &filter, unsigned n, BorderMode border = BorderWrap);
 
 #endif // _CONVOLUTION_H
@@ -0,0 +1,107 @@
+#include <algorithm>
+#include "../convolution.h"
+#include "../kernels/kernels.h"
+
+
+// Frequency domain implementation
+// Small, separable, sparse and box filters are still cheaper in the spatial domain
+// Fixed point filters stay there too
+void convolution(Image *out, const Image &in, const Filter &filter, BorderMode border)
+{
+    out->resize(in.width, in.height);
+
+    const size_t taps = filter.taps.empty() ? filter.width * filter.height
+                                            : filter.taps.size() * sparseTapCost;
+
+    if (filter.box)
+        boxConvolution(out, in, std::vector<Filter>(1, filter), border);
+    else if (!filter.terms.empty())
+        separableConvolution(out, in, filter, border, 0, in.width, 0, in.height);
+    else if (taps > fftThreshold && filter.fixed.coefficients.empty())
+        fftConvolution(out, in, filter, border);
+    else
+        simdConvolution(out, in, filter, border, 0, in.width, 0, in.height);
+}
+
+
+// Wider pixels stay in the spatial domain, the transforms are of 8 bit ones
+template <class P>
+static void wideConvolution(Matrix<P> *out, const Matrix<P> &in, const Filter &filter, BorderMode border)
+{
+    out->resize(in.width, in.height);
+
+    tileConvolution(out, in, filter, border, 0, in.width, 0, in.height);
+}
+
+
+void convolution(Image16 *out, const Image16 &in, const Filter &filter, BorderMode border)
+{
+    wideConvolution(out, in, filter, border);
+}
+
+
+void convolution(ImageF *out, const ImageF &in, const Filter &filter, BorderMode border)
+{
+    wideConvolution(out, in, filter, border);
+}
+
+
+void convolution(Image *out, const Image &in, const FilterChain &chain)
+{
+    if (chain.folded) {
+        convolution(out, in, chain.combined, chain.border);
+    }
+    else {
+        out->resize(in.width, in.height);
+        if (chain.boxes)
+            boxConvolution(out, in, chain.stages, chain.border);
+        else
+            chainConvolution(out, in, chain, 0, in.height);
+    }
+}
+
+
+// Planes stay in the spatial domain
+void convolution(PlanarImage *out, const PlanarImage &in, const Filter &filter, BorderMode border)
+{
+    out->resize(in.width, in.height, in.colors.size(), !in.opaque());
+
+    planarConvolution(out, in, filter, border, 0, in.height);
+}
+
+
+// As the serial one, filters large enough for the frequency domain are
+// applied to the whole image every iteration
+void convolveIterate(Image &image, const Filter &filter, unsigned n, BorderMode border)
+{
+    size_t bandRows, bandColumns;
+    const size_t block = iterationBlock(filter, image.width, &bandRows, &bandColumns);
+    Image bands[2];
+    Workspace workspace;
+
+    pingPong(image, n, block, [&](Image *out, const Image &in, size_t k) {
+        if (k == 1) {
+            convolution(out, in, filter, border);
+            return;
+        }
+        for (size_t y = 0; y < in.height; y += bandRows)
+            for (size_t x = 0; x < in.width; x += bandColumns)
+                iterateBand(out, in, filter, border, k, x, std::min(in.width, x + bandColumns),
+                            y, std::min(in.height, y + bandRows), bands, workspace);
+    });
+}
+
+
+// Regions stay in the spatial domain, the transform would cover the whole image
+void convolution(Image *out, const Image &in, const Filter &filter, const std::vector<Region> &regions,
+                 BorderMode border)
+{
+    regionOutput(out, in.width, in.height);
+
+    const std::vector<Region> tiles = regionTiles(regions, in.width, in.height, in.width, in.height);
+    Workspace workspace;
+    for (size_t i = 0; i < tiles.size(); ++i) {
+        const Region &r = tiles[i];
+        tileConvolution(out, in, filter, border, r.x, r.x + r.width, r.y, r.y + r.height, workspace);
+    }
+}
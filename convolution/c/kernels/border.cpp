@@ -0,0 +1,15 @@
+#include "kernels.h"
+
+
+std::vector<ptrdiff_t> borderTable(size_t size, size_t filterSize, BorderMode border)
+{
+    std::vector<ptrdiff_t> table;
+    if (size == 0 || filterSize == 0)
+        return table;
+
+    const ptrdiff_t half = filterSize / 2;
+    table.resize(size + filterSize - 1);
+    for (size_t p = 0; p < table.size(); ++p)
+        table[p] = borderIndex(static_cast<ptrdiff_t>(p) - half, size, border);
+    return table;
+}
@@ -0,0 +1,191 @@
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include "kernels.h"
+
+
+// dst[i] = sum of src[table[i + j]] for j in [0, size), for i in [0, n)
+// Each position holds count values, all summed at once; positions are
+// srcStride and dstStride floats apart. Entries of the table below 0 are
+// zeros. The window slides, so the cost does not depend on size
+static void slidingSums(float *dst, size_t dstStride, const float *src, size_t srcStride,
+                        size_t n, size_t count, const std::vector<ptrdiff_t> &table, size_t size,
+                        double *sums)
+{
+    std::fill(sums, sums + count, 0);
+
+    for (size_t i = 0; i + 1 < size; ++i) {
+        if (table[i] < 0)
+            continue;
+        const float *in = src + table[i] * srcStride;
+        for (size_t c = 0; c < count; ++c)
+            sums[c] += in[c];
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        const ptrdiff_t entering = table[i + size - 1], leaving = table[i];
+
+        if (entering >= 0) {
+            const float *in = src + entering * srcStride;
+            for (size_t c = 0; c < count; ++c)
+                sums[c] += in[c];
+        }
+
+        float *out = dst + i * dstStride;
+        for (size_t c = 0; c < count; ++c)
+            out[c] = sums[c];
+
+        if (leaving >= 0) {
+            const float *in = src + leaving * srcStride;
+            for (size_t c = 0; c < count; ++c)
+                sums[c] -= in[c];
+        }
+    }
+}
+
+
+void boxRows(Matrix<float> *sums, const Image &in, const std::vector<Filter> &boxes, BorderMode border,
+             size_t y0, size_t y1, Workspace &workspace)
+{
+    float *current = workspace.buffer<float>(0, 3 * in.width);
+    float *next = workspace.buffer<float>(1, 3 * in.width);
+    double accum[3];
+
+    for (size_t y = y0; y < y1; ++y) {
+        const Pixel *inRow = in.row(y);
+        for (size_t x = 0; x < in.width; ++x) {
+            current[3 * x]     = inRow[x].r;
+            current[3 * x + 1] = inRow[x].g;
+            current[3 * x + 2] = inRow[x].b;
+        }
+
+        // The last pass goes straight into sums
+        for (size_t k = 0; k < boxes.size(); ++k) {
+            float *dst = (k + 1 < boxes.size()) ? next : sums->row(y);
+            slidingSums(dst, 3, current, 3, in.width, 3, workspace.table(k, in.width, boxes[k].width, border),
+                        boxes[k].width, accum);
+            std::swap(current, next);
+        }
+    }
+}
+
+
+void boxColumns(Image *out, const Image &in, const Matrix<float> &sums, const std::vector<Filter> &boxes,
+                BorderMode border, size_t x0, size_t x1, Workspace &workspace)
+{
+    double scale = 1;
+    for (size_t k = 0; k < boxes.size(); ++k)
+        scale *= boxes[k].values[0];
+
+    // Two copies of a tile of columns, one for each side of a pass
+    // The tables of boxRows keep their slots, so both can share a workspace
+    const size_t tile = tileWidth(2 * 3 * sizeof(float) * in.height, 0, 4);
+    float *current = workspace.buffer<float>(0, 3 * tile * in.height);
+    float *next = workspace.buffer<float>(1, 3 * tile * in.height);
+    double *accum = workspace.buffer<double>(2, 3 * tile);
+
+    for (size_t tx = x0; tx < x1; tx += tile) {
+        const size_t width = std::min(tile, x1 - tx), count = 3 * width;
+
+        // The first pass reads from sums
+        for (size_t k = 0; k < boxes.size(); ++k) {
+            const std::vector<ptrdiff_t> &rows = workspace.table(boxes.size() + k, in.height, boxes[k].height,
+                                                                 border);
+            if (k == 0)
+                slidingSums(next, count, sums.row(0) + 3 * tx, sums.stride,
+                            in.height, count, rows, boxes[k].height, accum);
+            else
+                slidingSums(next, count, current, count,
+                            in.height, count, rows, boxes[k].height, accum);
+            std::swap(current, next);
+        }
+
+        for (size_t y = 0; y < in.height; ++y) {
+            const float *values = current + y * count;
+            const Pixel *inRow  = in.row(y) + tx;
+            Pixel       *outRow = out->row(y) + tx;
+            for (size_t x = 0; x < width; ++x) {
+                outRow[x].r = truncate(values[3 * x] * scale);
+                outRow[x].g = truncate(values[3 * x + 1] * scale);
+                outRow[x].b = truncate(values[3 * x + 2] * scale);
+                outRow[x].a = inRow[x].a;
+            }
+        }
+    }
+}
+
+
+void boxRows(Matrix<float> *sums, const Image &in, const std::vector<Filter> &boxes, BorderMode border,
+             size_t y0, size_t y1)
+{
+    Workspace workspace;
+    boxRows(sums, in, boxes, border, y0, y1, workspace);
+}
+
+
+void boxColumns(Image *out, const Image &in, const Matrix<float> &sums, const std::vector<Filter> &boxes,
+                BorderMode border, size_t x0, size_t x1)
+{
+    Workspace workspace;
+    boxColumns(out, in, sums, boxes, border, x0, x1, workspace);
+}
+
+
+void boxConvolution(Image *out, const Image &in, const std::vector<Filter> &boxes, BorderMode border)
+{
+    Matrix<float> sums(3 * in.width, in.height);
+    Workspace workspace;
+    boxRows(&sums, in, boxes, border, 0, in.height, workspace);
+    boxColumns(out, in, sums, boxes, border, 0, in.width, workspace);
+}
+
+
+// Below it, the narrowest boxes are 1 wide and only approximate the Gaussian
+// with fewer passes, or not at all
+static const double minBoxSigma = 1.5;
+
+
+std::vector<Filter> gaussianBoxes(double sigma)
+{
+    if (!(sigma > 0))
+        throw std::runtime_error("The standard deviation of a Gaussian must be positive");
+
+    // Sampled instead, 3 sigma on each side. It is planned as separable
+    if (sigma < minBoxSigma) {
+        const size_t half = static_cast<size_t>(std::ceil(3 * sigma)), size = 2 * half + 1;
+        std::vector<double> weights(size);
+        double sum = 0;
+        for (size_t i = 0; i < size; ++i) {
+            const double d = static_cast<double>(i) - half;
+            weights[i] = std::exp(-d * d / (2 * sigma * sigma));
+            sum += weights[i];
+        }
+
+        Filter gaussian(size);
+        for (size_t y = 0; y < size; ++y)
+            for (size_t x = 0; x < size; ++x)
+                gaussian[y][x] = weights[y] * weights[x] / (sum * sum);
+        gaussian.plan();
+        return std::vector<Filter>(1, gaussian);
+    }
+
+    // Three passes, m of them of an odd width wl and the rest of wl + 2, with
+    // variances ((w^2 - 1) / 12 each) adding up as close as possible to sigma^2
+    const size_t n = 3;
+    const double variance = sigma * sigma;
+    size_t wl = static_cast<size_t>(std::sqrt(12 * variance / n + 1));
+    if (wl % 2 == 0)
+        --wl;
+    const double m = std::round((12 * variance - n * wl * wl - 4.0 * n * wl - 3.0 * n) / (-4.0 * wl - 4));
+
+    std::vector<Filter> boxes;
+    for (size_t i = 0; i < n; ++i) {
+        const size_t w = (i < m) ? wl : wl + 2;
+        Filter box(w);
+        for (size_t y = 0; y < w; ++y)
+            std::fill(box.row(y), box.row(y) + w, 1.0 / (w * w));
+        box.plan();
+        boxes.push_back(box);
+    }
+    return boxes;
+}
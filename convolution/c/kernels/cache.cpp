@@ -0,0 +1,36 @@
+#include <algorithm>
+#include <cstdlib>
+#include <unistd.h>
+#include "kernels.h"
+
+
+// Used when sysconf does not know
+static const size_t defaultCacheSize = 256 * 1024;
+
+
+static size_t detectCacheSize()
+{
+    long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    return (l2 > 0) ? l2 : defaultCacheSize;
+}
+
+
+size_t cacheSize()
+{
+    static const size_t size = detectCacheSize();
+    return size;
+}
+
+
+size_t tileWidth(size_t bytesPerColumn, size_t halo, size_t multiple)
+{
+    const char *forced = getenv("CONVOLUTION_TILE_WIDTH");
+    if (forced && atol(forced) > 0)
+        return std::max<size_t>(multiple, atol(forced) / multiple * multiple);
+
+    size_t columns = cacheSize() / 2 / std::max<size_t>(bytesPerColumn, 1);
+    columns = (columns > halo) ? columns - halo : 0;
+
+    // Not worth going under a few vectors
+    return std::max(4 * multiple, columns / multiple * multiple);
+}
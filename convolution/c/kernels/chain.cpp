@@ -0,0 +1,181 @@
+#include <algorithm>
+#include "kernels.h"
+
+
+// Full 2D convolution of two filters: the filter that applied once does
+// the same as a, then b. Sizes add up; when the centre would not line up
+// with size / 2 (two even sizes) a zero row or column is appended
+static Filter compose(const Filter &a, const Filter &b)
+{
+    size_t w = a.width + b.width - 1, h = a.height + b.height - 1;
+    if (w / 2 != a.width / 2 + b.width / 2)
+        ++w;
+    if (h / 2 != a.height / 2 + b.height / 2)
+        ++h;
+
+    Filter c(w, h);
+    for (size_t ay = 0; ay < a.height; ++ay)
+        for (size_t ax = 0; ax < a.width; ++ax)
+            for (size_t by = 0; by < b.height; ++by)
+                for (size_t bx = 0; bx < b.width; ++bx)
+                    c[ay + by][ax + bx] += a[ay][ax] * b[by][bx];
+    return c;
+}
+
+
+FilterChain::FilterChain(const std::vector<Filter> &stages, BorderMode border):
+    stages(stages), border(border), folded(false), boxes(!stages.empty())
+{
+    for (size_t i = 0; i < stages.size(); ++i)
+        boxes = boxes && stages[i].box;
+    if (boxes)
+        return;
+
+    // Periodic convolutions compose exactly. With any other border the edges
+    // of an intermediate image are not what the combined filter would read
+    if (border != BorderWrap || stages.size() < 2)
+        return;
+
+    combined = stages[0];
+    for (size_t i = 1; i < stages.size(); ++i)
+        combined = compose(combined, stages[i]);
+    combined.plan();
+    folded = true;
+}
+
+
+// Like accumulateRow, for a row of an intermediate stage (three interleaved
+// channels per pixel)
+static void accumulateStageRow(double *accum, const double *src, size_t width,
+                               const double *filterRow, size_t filterWidth,
+                               const std::vector<ptrdiff_t> &columns)
+{
+    for (size_t x = 0; x < width; ++x) {
+        double red = accum[3 * x], green = accum[3 * x + 1], blue = accum[3 * x + 2];
+
+        for (size_t filterX = 0; filterX < filterWidth; ++filterX) {
+            ptrdiff_t imageX = columns[x + filterX];
+            if (imageX < 0)
+                continue;
+
+            red   += src[3 * imageX] * filterRow[filterX];
+            green += src[3 * imageX + 1] * filterRow[filterX];
+            blue  += src[3 * imageX + 2] * filterRow[filterX];
+        }
+
+        accum[3 * x]     = red;
+        accum[3 * x + 1] = green;
+        accum[3 * x + 2] = blue;
+    }
+}
+
+
+namespace {
+
+// Output rows of the stages of a chain, computed on demand
+// Each stage keeps the last rows it produced in a ring, as many as the
+// next stage reads at once, so no intermediate image is ever complete
+class ChainRows
+{
+public:
+    ChainRows(const Image &in, const FilterChain &chain): in(in), chain(chain)
+    {
+        const size_t n = chain.stages.size();
+        columns.resize(n);
+        rows.resize(n);
+        rings.resize(n);
+        held.resize(n);
+
+        for (size_t s = 0; s < n; ++s) {
+            const Filter &filter = chain.stages[s];
+            columns[s] = borderTable(in.width, filter.width, chain.border);
+            rows[s] = borderTable(in.height, filter.height, chain.border);
+
+            // Row y goes to the slot y % slots, and stays there until a row
+            // that maps to the same slot is asked for and takes it over.
+            // Going down the image, that is the row the next stage no longer
+            // reads. Near a wrapped or mirrored edge the rows read for one
+            // output row can map to the same slot, and then take it over from
+            // each other. Each row is accumulated before the next one is
+            // fetched, so that only costs computing it again
+            if (s + 1 < n) {
+                const size_t slots = std::max<size_t>(1, chain.stages[s + 1].height);
+                rings[s].resize(3 * in.width, slots);
+                held[s].assign(slots, -1);
+            }
+        }
+    }
+
+    // Applies the stage s for the image row y, into accum
+    void compute(size_t s, size_t y, double *accum)
+    {
+        const Filter &filter = chain.stages[s];
+        std::fill(accum, accum + 3 * in.width, 0);
+
+        for (size_t filterY = 0; filterY < filter.height; ++filterY) {
+            ptrdiff_t imageY = rows[s][y + filterY];
+            if (imageY < 0)
+                continue;
+
+            if (s == 0)
+                accumulateRow(accum, in.row(imageY), in.width, filter.row(filterY), filter.width,
+                              columns[s], 0, in.width);
+            else
+                accumulateStageRow(accum, row(s - 1, imageY), in.width, filter.row(filterY), filter.width,
+                                   columns[s]);
+        }
+    }
+
+    // Row y of the output of the stage s, from its ring if still there
+    const double* row(size_t s, size_t y)
+    {
+        const size_t slot = y % held[s].size();
+        double *values = rings[s].row(slot);
+
+        if (held[s][slot] != static_cast<ptrdiff_t>(y)) {
+            compute(s, y, values);
+            held[s][slot] = y;
+        }
+        return values;
+    }
+
+private:
+    const Image &in;
+    const FilterChain &chain;
+    std::vector<std::vector<ptrdiff_t> > columns, rows;
+    std::vector<Matrix<double> > rings;
+    std::vector<std::vector<ptrdiff_t> > held;
+};
+
+}
+
+
+void chainConvolution(Image *out, const Image &in, const FilterChain &chain, size_t y0, size_t y1)
+{
+    if (chain.folded) {
+        bandConvolution(out, in, chain.combined, chain.border, y0, y1);
+        return;
+    }
+    if (chain.stages.empty()) {
+        for (size_t y = y0; y < y1; ++y)
+            std::copy(in.row(y), in.row(y) + in.width, out->row(y));
+        return;
+    }
+
+    ChainRows stages(in, chain);
+    std::vector<double> accum(3 * in.width);
+
+    for (size_t y = y0; y < y1; ++y) {
+        stages.compute(chain.stages.size() - 1, y, accum.data());
+
+        // truncate values smaller than 0 and larger than 255
+        const Pixel *inRow  = in.row(y);
+        Pixel       *outRow = out->row(y);
+        for (size_t x = 0; x < in.width; ++x) {
+            outRow[x].r = truncate(accum[3 * x]);
+            outRow[x].g = truncate(accum[3 * x + 1]);
+            outRow[x].b = truncate(accum[3 * x + 2]);
+            outRow[x].a = inRow[x].a;
+        }
+    }
+}
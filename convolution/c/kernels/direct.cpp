@@ -0,0 +1,135 @@
+#include <algorithm>
+#include "kernels.h"
+
+
+// Output pixels [x0, x1) whose taps are all in the row
+// accum holds the pixels from base on
+template <class P>
+static void interiorPixels(double *accum, size_t base, const P *src, const double *filterRow,
+                           size_t filterWidth, size_t x0, size_t x1)
+{
+    const size_t half = filterWidth / 2;
+
+    for (size_t x = x0; x < x1; ++x) {
+        const P *p = src + x - half;
+        double *a = accum + 3 * (x - base);
+        double red = a[0], green = a[1], blue = a[2];
+
+        for (size_t filterX = 0; filterX < filterWidth; ++filterX) {
+            red   += p[filterX].r * filterRow[filterX];
+            green += p[filterX].g * filterRow[filterX];
+            blue  += p[filterX].b * filterRow[filterX];
+        }
+
+        a[0] = red;
+        a[1] = green;
+        a[2] = blue;
+    }
+}
+
+
+// Output pixels [x0, x1) near the edges, columns go through the border table
+template <class P>
+static void borderPixels(double *accum, size_t base, const P *src, const double *filterRow,
+                         size_t filterWidth, const ptrdiff_t *columns, size_t x0, size_t x1)
+{
+    for (size_t x = x0; x < x1; ++x) {
+        double *a = accum + 3 * (x - base);
+        double red = a[0], green = a[1], blue = a[2];
+
+        for (size_t filterX = 0; filterX < filterWidth; ++filterX) {
+            ptrdiff_t imageX = columns[x + filterX];
+            if (imageX < 0)
+                continue;
+
+            red   += src[imageX].r * filterRow[filterX];
+            green += src[imageX].g * filterRow[filterX];
+            blue  += src[imageX].b * filterRow[filterX];
+        }
+
+        a[0] = red;
+        a[1] = green;
+        a[2] = blue;
+    }
+}
+
+
+template <class P>
+void accumulateRow(double *accum, const P *src, size_t width,
+                   const double *filterRow, size_t filterWidth, const std::vector<ptrdiff_t> &columns,
+                   size_t x0, size_t x1)
+{
+    const size_t half = filterWidth / 2;
+
+    // Output columns [interiorBegin, interiorEnd) never read past the edges
+    size_t interiorBegin = std::min(half, width);
+    size_t interiorEnd = (width + half + 1 > filterWidth) ? width + half + 1 - filterWidth : 0;
+    interiorEnd = std::max(interiorBegin, interiorEnd);
+
+    // Clipped to [x0, x1)
+    interiorBegin = std::min(std::max(interiorBegin, x0), x1);
+    interiorEnd   = std::max(std::min(interiorEnd, x1), interiorBegin);
+
+    borderPixels(accum, x0, src, filterRow, filterWidth, columns.data(), x0, interiorBegin);
+    interiorPixels(accum, x0, src, filterRow, filterWidth, interiorBegin, interiorEnd);
+    borderPixels(accum, x0, src, filterRow, filterWidth, columns.data(), interiorEnd, x1);
+}
+
+
+// Adapted from http://lodev.org/cgtutor/filtering.html
+template <class P>
+void directConvolution(Matrix<P> *out, const Matrix<P> &in, const Filter &filter, BorderMode border,
+                       size_t x0, size_t x1, size_t y0, size_t y1, Workspace &workspace)
+{
+    const size_t width = in.width;
+    const std::vector<ptrdiff_t> &columns = workspace.table(0, in.width, filter.width, border);
+    const std::vector<ptrdiff_t> &rows = workspace.table(1, in.height, filter.height, border);
+
+    // Output columns [x0, x1) only
+    double *accum = workspace.buffer<double>(0, 3 * (x1 - x0));
+
+    for (size_t y = y0; y < y1; ++y) {
+        std::fill(accum, accum + 3 * (x1 - x0), 0);
+
+        for (size_t filterY = 0; filterY < filter.height; ++filterY) {
+            ptrdiff_t imageY = rows[y + filterY];
+            if (imageY >= 0)
+                accumulateRow(accum, in.row(imageY), width, filter.row(filterY), filter.width, columns,
+                              x0, x1);
+        }
+
+        // truncate values smaller than 0 and larger than 255
+        typedef typename P::Channel Channel;
+        const P *inRow  = in.row(y);
+        P       *outRow = out->row(y);
+        for (size_t x = x0; x < x1; ++x) {
+            outRow[x].r = toChannel<Channel>(accum[3 * (x - x0)]);
+            outRow[x].g = toChannel<Channel>(accum[3 * (x - x0) + 1]);
+            outRow[x].b = toChannel<Channel>(accum[3 * (x - x0) + 2]);
+            outRow[x].a = inRow[x].a;
+        }
+    }
+}
+
+
+template <class P>
+void directConvolution(Matrix<P> *out, const Matrix<P> &in, const Filter &filter, BorderMode border,
+                       size_t x0, size_t x1, size_t y0, size_t y1)
+{
+    Workspace workspace;
+    directConvolution(out, in, filter, border, x0, x1, y0, y1, workspace);
+}
+
+
+// For every kind of pixel
+#define INSTANTIATE(P) \
+    template void accumulateRow(double*, const P*, size_t, const double*, size_t, \
+                                const std::vector<ptrdiff_t>&, size_t, size_t); \
+    template void directConvolution(Matrix<P>*, const Matrix<P>&, const Filter&, BorderMode, \
+                                    size_t, size_t, size_t, size_t); \
+    template void directConvolution(Matrix<P>*, const Matrix<P>&, const Filter&, BorderMode, \
+                                    size_t, size_t, size_t, size_t, Workspace&);
+
+INSTANTIATE(Pixel)
+INSTANTIATE(Pixel16)
+INSTANTIATE(PixelF)
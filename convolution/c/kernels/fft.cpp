@@ -0,0 +1,211 @@
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include "kernels.h"
+
+
+typedef std::complex<double> Complex;
+
+
+// Smallest power of two >= n
+static size_t nextPowerOfTwo(size_t n)
+{
+    size_t p = 1;
+    while (p < n)
+        p <<= 1;
+    return p;
+}
+
+
+// In place, iterative radix-2 FFT
+class Fft
+{
+public:
+    explicit Fft(size_t n): n(n), twiddles(n / 2)
+    {
+        for (size_t k = 0; k < n / 2; ++k)
+            twiddles[k] = std::polar(1.0, -2 * M_PI * k / n);
+    }
+
+    void transform(Complex *data, bool inverse) const
+    {
+        // Bit reversal permutation
+        for (size_t i = 1, j = 0; i < n; ++i) {
+            size_t bit = n >> 1;
+            for (; j & bit; bit >>= 1)
+                j ^= bit;
+            j ^= bit;
+            if (i < j)
+                std::swap(data[i], data[j]);
+        }
+
+        for (size_t len = 2; len <= n; len <<= 1) {
+            const size_t half = len / 2, step = n / len;
+            for (size_t i = 0; i < n; i += len) {
+                for (size_t k = 0; k < half; ++k) {
+                    Complex w = inverse ? std::conj(twiddles[k * step]) : twiddles[k * step];
+                    Complex u = data[i + k], v = data[i + k + half] * w;
+                    data[i + k]        = u + v;
+                    data[i + k + half] = u - v;
+                }
+            }
+        }
+    }
+
+private:
+    size_t n;
+    std::vector<Complex> twiddles;
+};
+
+
+// 2D FFT over a width x height row-major buffer
+class Fft2D
+{
+public:
+    Fft2D(size_t width, size_t height): width(width), height(height),
+        rows(width), columns(height), column(height)
+    {
+    }
+
+    void transform(Complex *data, bool inverse)
+    {
+        for (size_t y = 0; y < height; ++y)
+            rows.transform(data + y * width, inverse);
+
+        for (size_t x = 0; x < width; ++x) {
+            for (size_t y = 0; y < height; ++y)
+                column[y] = data[y * width + x];
+            columns.transform(column.data(), inverse);
+            for (size_t y = 0; y < height; ++y)
+                data[y * width + x] = column[y];
+        }
+    }
+
+private:
+    size_t width, height;
+    Fft rows, columns;
+    std::vector<Complex> column;
+};
+
+
+// The transforms leave an error of the order of 1e-12 on the results,
+// nudge them so exact integers are not truncated down to the level below
+static const double roundoff = 1e-7;
+
+
+// Transform size for one of the filter dimensions
+// Bigger tiles waste less on the overlap, but stop fitting in cache
+static size_t transformSize(size_t filterSize)
+{
+    return std::max<size_t>(64, nextPowerOfTwo(4 * filterSize));
+}
+
+
+struct FftFilter::State
+{
+    size_t nx, ny, tileWidth, tileHeight;
+    std::vector<ptrdiff_t> columns, rows;
+    Fft2D fft;
+    std::vector<Complex> kernel, redGreen, blue;
+
+    State(const Filter &filter, size_t width, size_t height, BorderMode border):
+        nx(transformSize(filter.width)), ny(transformSize(filter.height)),
+        tileWidth(nx - filter.width + 1), tileHeight(ny - filter.height + 1),
+        columns(borderTable(width, filter.width, border)), rows(borderTable(height, filter.height, border)),
+        fft(nx, ny), kernel(nx * ny), redGreen(nx * ny), blue(nx * ny)
+    {
+        const double scale = 1.0 / (nx * ny);
+
+        // out(x) = sum in(x - half + f) * filter(f) is a circular convolution
+        // with filter(-j mod n) in j
+        for (size_t filterY = 0; filterY < filter.height; ++filterY)
+            for (size_t filterX = 0; filterX < filter.width; ++filterX)
+                kernel[((ny - filterY) % ny) * nx + (nx - filterX) % nx] = filter[filterY][filterX] * scale;
+        fft.transform(kernel.data(), false);
+    }
+};
+
+
+FftFilter::FftFilter(const Filter &filter, size_t width, size_t height, BorderMode border):
+    state(new State(filter, width, height, border))
+{
+}
+
+
+FftFilter::~FftFilter()
+{
+}
+
+
+// Overlap-save: every output tile is computed from the input tile plus its
+// halo (as given by the border mode), and the part of the circular
+// convolution not polluted by the wrap is exactly the convolution of the image
+void FftFilter::apply(Image *out, const Image &in)
+{
+    const size_t nx = state->nx, ny = state->ny;
+    const size_t tileWidth = state->tileWidth, tileHeight = state->tileHeight;
+    const std::vector<ptrdiff_t> &columns = state->columns, &rows = state->rows;
+    const std::vector<Complex> &kernel = state->kernel;
+    std::vector<Complex> &redGreen = state->redGreen, &blue = state->blue;
+
+    // Red and green share a transform as the real and imaginary parts,
+    // since the filter is real the results do not mix
+    for (size_t y0 = 0; y0 < in.height; y0 += tileHeight) {
+        for (size_t x0 = 0; x0 < in.width; x0 += tileWidth) {
+            // Input tile plus halo, anything past it does not reach the
+            // valid part of the result
+            std::fill(redGreen.begin(), redGreen.end(), Complex());
+            std::fill(blue.begin(), blue.end(), Complex());
+
+            for (size_t v = 0; v < ny && y0 + v < rows.size(); ++v) {
+                if (rows[y0 + v] < 0)
+                    continue;
+                const Pixel *inRow = in.row(rows[y0 + v]);
+
+                for (size_t u = 0; u < nx && x0 + u < columns.size(); ++u) {
+                    if (columns[x0 + u] < 0)
+                        continue;
+                    const Pixel &p = inRow[columns[x0 + u]];
+
+                    redGreen[v * nx + u] = Complex(p.r, p.g);
+                    blue[v * nx + u]     = Complex(p.b, 0);
+                }
+            }
+
+            state->fft.transform(redGreen.data(), false);
+            state->fft.transform(blue.data(), false);
+            for (size_t i = 0; i < kernel.size(); ++i) {
+                redGreen[i] *= kernel[i];
+                blue[i]     *= kernel[i];
+            }
+            state->fft.transform(redGreen.data(), true);
+            state->fft.transform(blue.data(), true);
+
+            // truncate values smaller than 0 and larger than 255
+            const size_t x1 = std::min(in.width, x0 + tileWidth);
+            const size_t y1 = std::min(in.height, y0 + tileHeight);
+            for (size_t y = y0; y < y1; ++y) {
+                const Pixel *inRow  = in.row(y);
+                Pixel       *outRow = out->row(y);
+                const Complex *rg = redGreen.data() + (y - y0) * nx;
+                const Complex *b  = blue.data() + (y - y0) * nx;
+
+                for (size_t x = x0; x < x1; ++x) {
+                    outRow[x].r = truncate(rg[x - x0].real() + roundoff);
+                    outRow[x].g = truncate(rg[x - x0].imag() + roundoff);
+                    outRow[x].b = truncate(b[x - x0].real() + roundoff);
+                    outRow[x].a = inRow[x].a;
+                }
+            }
+        }
+    }
+}
+
+
+void fftConvolution(Image *out, const Image &in, const Filter &filter, BorderMode border)
+{
+    if (in.width == 0 || in.height == 0)
+        return;
+
+    FftFilter(filter, in.width, in.height, border).apply(out, in);
+}
@@ -0,0 +1,133 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "kernels.h"
+
+
+// Iterations applied to a band at once, at most
+static const size_t maxIterationBlock = 8;
+
+
+// Copies n pixels of a row, from the column `from` on, going around the edges
+static void copyCyclic(Pixel *dst, const Pixel *row, ptrdiff_t from, size_t n, size_t width)
+{
+    while (n > 0) {
+        const size_t x = borderIndex(from, width, BorderWrap);
+        const size_t run = std::min(n, width - x);
+        memcpy(dst, row + x, run * sizeof(Pixel));
+        dst  += run;
+        from += run;
+        n    -= run;
+    }
+}
+
+
+size_t iterationBlock(const Filter &filter, size_t width, size_t *bandRows, size_t *bandColumns)
+{
+    *bandRows = width ? width : 1;
+    *bandColumns = width;
+
+    // Nothing to block on an empty image or filter
+    if (width == 0 || filter.width == 0 || filter.height == 0)
+        return 1;
+
+    // Boxes and the largest filters are applied to the whole image at once
+    const size_t taps = filter.taps.empty() ? filter.width * filter.height
+                                            : filter.taps.size() * sparseTapCost;
+    if (filter.box || (filter.terms.empty() && taps > fftThreshold && filter.fixed.coefficients.empty()))
+        return 1;
+
+    // Both copies of a tile, halo included, within half of the L2 cache
+    // Whole rows while enough of them fit, square tiles otherwise, so wide
+    // images are blocked too. The halo, recomputed by both tiles next to it,
+    // is kept to an eighth of a side, so the iterations do not cost much more
+    // than on their own
+    const size_t pixels = cacheSize() / 2 / (2 * sizeof(Pixel));
+    const size_t side = static_cast<size_t>(std::sqrt(static_cast<double>(pixels)));
+    const size_t columns = std::min(width, side), rows = pixels / std::max<size_t>(columns, 1);
+    const bool tiled = columns < width;
+    const size_t haloRows = std::max<size_t>(filter.height / 2, 1);
+    const size_t haloColumns = tiled ? std::max<size_t>(filter.width / 2, 1) : 0;
+
+    size_t block = std::min(maxIterationBlock, rows / (16 * haloRows));
+    if (tiled)
+        block = std::min(block, columns / (16 * haloColumns));
+    if (block < 2)
+        return 1;
+
+    *bandRows = rows - 2 * block * haloRows;
+    *bandColumns = tiled ? columns - 2 * block * haloColumns : width;
+    return block;
+}
+
+
+void iterateBand(Image *out, const Image &in, const Filter &filter, BorderMode border, size_t iterations,
+                 size_t x0, size_t x1, size_t y0, size_t y1, Image *bands, Workspace &workspace)
+{
+    const bool wrap = border == BorderWrap;
+
+    // Rows [a, b) and columns [c, d) of the image, the ones the tile depends
+    // on. Periodic images go on past their edges. Otherwise the tile stops at
+    // them, and reads across them as the whole image would. A tile of whole
+    // rows reads across the left and right edges itself, whatever the border
+    const ptrdiff_t height = in.height, haloY = iterations * (filter.height / 2);
+    const ptrdiff_t a = wrap ? ptrdiff_t(y0) - haloY : std::max<ptrdiff_t>(0, ptrdiff_t(y0) - haloY);
+    const ptrdiff_t b = wrap ? ptrdiff_t(y1) + haloY : std::min<ptrdiff_t>(height, ptrdiff_t(y1) + haloY);
+    const bool top = !wrap && a == 0, bottom = !wrap && b == height;
+
+    const bool whole = x0 == 0 && x1 == in.width;
+    const ptrdiff_t width = in.width, haloX = whole ? 0 : iterations * (filter.width / 2);
+    const ptrdiff_t c = wrap ? ptrdiff_t(x0) - haloX : std::max<ptrdiff_t>(0, ptrdiff_t(x0) - haloX);
+    const ptrdiff_t d = wrap ? ptrdiff_t(x1) + haloX : std::min<ptrdiff_t>(width, ptrdiff_t(x1) + haloX);
+    const bool left = whole || (!wrap && c == 0), right = whole || (!wrap && d == width);
+
+    const size_t length = b - a, span = d - c;
+
+    // They only ever grow, the views are of the size of the tile
+    Image views[2];
+    for (size_t i = 0; i < 2; ++i) {
+        if (bands[i].width < span || bands[i].height < length)
+            bands[i].resizeUninitialized(std::max(bands[i].width, span), std::max(bands[i].height, length));
+        views[i] = Image(bands[i].values, span, length, bands[i].stride);
+    }
+
+    for (size_t j = 0; j < length; ++j)
+        copyCyclic(views[0].row(j), in.row(borderIndex(a + ptrdiff_t(j), height, BorderWrap)), c, span, in.width);
+
+    // Each iteration is valid on a smaller part than the one before, except
+    // along the edges of the image
+    for (size_t t = 1; t <= iterations; ++t) {
+        const size_t lo = top ? 0 : t * (filter.height / 2);
+        const size_t hi = bottom ? length : length - t * (filter.height / 2);
+        const size_t from = left ? 0 : t * (filter.width / 2);
+        const size_t to = right ? span : span - t * (filter.width / 2);
+        tileConvolution(&views[t % 2], views[(t - 1) % 2], filter, border, from, to, lo, hi, workspace);
+    }
+
+    const Image &result = views[iterations % 2];
+    for (size_t y = y0; y < y1; ++y)
+        memcpy(out->row(y) + x0, result.row(y - a) + (x0 - c), (x1 - x0) * sizeof(Pixel));
+}
+
+
+void pingPong(Image &image, unsigned n, size_t block,
+              const std::function<void(Image*, const Image&, size_t)> &pass)
+{
+    Image scratch(image.width, image.height);
+    Image *src = &image, *dst = &scratch;
+
+    for (unsigned done = 0; done < n;) {
+        const size_t k = std::min<size_t>(block, n - done);
+        pass(dst, *src, k);
+        std::swap(src, dst);
+        done += k;
+    }
+
+    // A view keeps its storage, the result is copied there
+    if (src != &image) {
+        if (image.owner())
+            std::swap(image, scratch);
+        else
+            image = scratch;
+    }
+}
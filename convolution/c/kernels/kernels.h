@@ -0,0 +1,287 @@
+#ifndef _KERNELS_H_
+#define _KERNELS_H_
+
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include "../convolution.h"
+
+// Building blocks shared by the different convolution implementations
+// They work on a band of output rows [y0, y1), so the caller decides
+// how the bands are split between threads
+
+// Clamps to [0, 255]
+inline uint8_t truncate(double v)
+{
+    int vi = static_cast<int>(v);
+    if (vi < 0)   vi = 0;
+    if (vi > 255) vi = 255;
+
+    return static_cast<uint8_t>(vi);
+}
+
+// A sum back to a channel of a pixel: integer ones are clamped to their
+// range, as truncate does, float ones kept as they are
+template <class T>
+T toChannel(double v);
+
+template <>
+inline uint8_t toChannel<uint8_t>(double v)
+{
+    return truncate(v);
+}
+
+template <>
+inline uint16_t toChannel<uint16_t>(double v)
+{
+    int vi = static_cast<int>(v);
+    if (vi < 0)     vi = 0;
+    if (vi > 65535) vi = 65535;
+
+    return static_cast<uint16_t>(vi);
+}
+
+template <>
+inline float toChannel<float>(double v)
+{
+    return static_cast<float>(v);
+}
+
+// Maps a coordinate that may fall outside [0, size) to the one to read,
+// or -1 if the pixel is to be taken as zero
+inline ptrdiff_t borderIndex(ptrdiff_t i, ptrdiff_t size, BorderMode border)
+{
+    if (i >= 0 && i < size)
+        return i;
+
+    switch (border) {
+        case BorderClamp:
+            return i < 0 ? 0 : size - 1;
+        case BorderMirror: {
+            if (size == 1)
+                return 0;
+            ptrdiff_t period = 2 * (size - 1);
+            i = ((i % period) + period) % period;
+            return i < size ? i : period - i;
+        }
+        case BorderZero:
+            return -1;
+        default:
+            return ((i % size) + size) % size;
+    }
+}
+
+// borderIndex for every position a filter of filterSize taps reads when
+// sliding over size pixels: entry p holds the pixel for p - filterSize / 2
+std::vector<ptrdiff_t> borderTable(size_t size, size_t filterSize, BorderMode border);
+
+// Scratch space the kernels below keep between calls, so calling one again
+// on an image of the same size allocates nothing. Each kernel numbers its
+// own tables and buffers from 0; a buffer only ever grows
+// Not to be used by two threads at once
+class Workspace
+{
+public:
+    // borderTable(size, filterSize, border), kept until asked with others
+    const std::vector<ptrdiff_t>& table(size_t slot, size_t size, size_t filterSize, BorderMode border);
+
+    // Room for n elements of a plain type, aligned to MATRIX_ALIGNMENT
+    // Holds whatever was left there
+    template <class T>
+    T* buffer(size_t slot, size_t n)
+    {
+        return reinterpret_cast<T*>(bytes(slot, n * sizeof(T)));
+    }
+
+    // View on a buffer, with aligned rows
+    template <class T>
+    Matrix<T> matrix(size_t slot, size_t w, size_t h)
+    {
+        const size_t stride = Matrix<T>::alignedStride(w);
+        return Matrix<T>(buffer<T>(slot, stride * h), w, h, stride);
+    }
+
+private:
+    struct Table
+    {
+        size_t size, filterSize;
+        BorderMode border;
+        std::vector<ptrdiff_t> entries;
+    };
+
+    // Deques, so growing them does not move what was handed out
+    std::deque<Table> tables;
+    std::deque<Matrix<uint8_t> > buffers;
+
+    uint8_t* bytes(size_t slot, size_t n);
+};
+
+// Adds to accum (three interleaved channels per pixel, starting at x0) one
+// row of taps slid over the output columns [x0, x1) of a source row,
+// skipping the border mapping where it is not needed
+// Like the templates below, it exists for Pixel, Pixel16 and PixelF
+template <class P>
+void accumulateRow(double *accum, const P *src, size_t width,
+                   const double *filterRow, size_t filterWidth, const std::vector<ptrdiff_t> &columns,
+                   size_t x0, size_t x1);
+
+// L2 cache size, from sysconf
+size_t cacheSize();
+
+// Width of the column tiles a band is split into, so the working set of a
+// tile (bytesPerColumn for each of its columns plus the halo ones) stays
+// within half of the L2 cache. The result is a multiple of `multiple`
+// Can be forced with the environment variable CONVOLUTION_TILE_WIDTH
+size_t tileWidth(size_t bytesPerColumn, size_t halo, size_t multiple);
+
+// Straightforward implementation, filter.width * filter.height taps per pixel
+// Like the kernels below, it computes the output columns [x0, x1) of the rows
+// [y0, y1), reading whatever it needs around them
+template <class P>
+void directConvolution(Matrix<P> *out, const Matrix<P> &in, const Filter &filter, BorderMode border,
+                       size_t x0, size_t x1, size_t y0, size_t y1);
+// The kernels taking a Workspace keep their scratch there, the others in a
+// temporary one
+template <class P>
+void directConvolution(Matrix<P> *out, const Matrix<P> &in, const Filter &filter, BorderMode border,
+                       size_t x0, size_t x1, size_t y0, size_t y1, Workspace &workspace);
+
+// Same as directConvolution, but on float vectors of the widest instruction
+// set the CPU supports (checked on first use), several output pixels at a time
+// Sparse filters (Filter::taps) only go through their non zero taps, and
+// fixed point ones (Filter::fixed) are accumulated on 32 bit integers, on
+// 8 bit pixels only (wider ones use the coefficients of the filter)
+// Falls back to directConvolution, in double precision, if there is none
+template <class P>
+void simdConvolution(Matrix<P> *out, const Matrix<P> &in, const Filter &filter, BorderMode border,
+                     size_t x0, size_t x1, size_t y0, size_t y1);
+template <class P>
+void simdConvolution(Matrix<P> *out, const Matrix<P> &in, const Filter &filter, BorderMode border,
+                     size_t x0, size_t x1, size_t y0, size_t y1, Workspace &workspace);
+
+// Same as simdConvolution, for the whole width of a single channel plane
+void simdConvolution(Plane *out, const Plane &in, const Filter &filter, BorderMode border,
+                     size_t y0, size_t y1);
+
+// Name of the instruction set simdConvolution ended up using
+const char* simdName();
+
+// Decomposes the matrix into a sum of outer products (via SVD), dropping
+// terms whose singular value is negligible
+std::vector<FilterTerm> decompose(const Matrix<double> &m);
+
+// Applies the separable decomposition of the filter, one horizontal and
+// one vertical pass per term
+template <class P>
+void separableConvolution(Matrix<P> *out, const Matrix<P> &in, const Filter &filter, BorderMode border,
+                          size_t x0, size_t x1, size_t y0, size_t y1);
+template <class P>
+void separableConvolution(Matrix<P> *out, const Matrix<P> &in, const Filter &filter, BorderMode border,
+                          size_t x0, size_t x1, size_t y0, size_t y1, Workspace &workspace);
+
+// A tap of a sparse filter costs as much as this many taps of a dense one,
+// it is looked up instead of walked in order
+static const size_t sparseTapCost = 2;
+
+// Applies the filter over the tile with the cheapest of the kernels above,
+// as decided by Filter::plan
+// Boxes go through their separable decomposition here
+template <class P>
+void tileConvolution(Matrix<P> *out, const Matrix<P> &in, const Filter &filter, BorderMode border,
+                     size_t x0, size_t x1, size_t y0, size_t y1);
+template <class P>
+void tileConvolution(Matrix<P> *out, const Matrix<P> &in, const Filter &filter, BorderMode border,
+                     size_t x0, size_t x1, size_t y0, size_t y1, Workspace &workspace);
+
+// Same as tileConvolution, for the whole width of the rows [y0, y1)
+void bandConvolution(Image *out, const Image &in, const Filter &filter, BorderMode border,
+                     size_t y0, size_t y1);
+
+// Applies the stages of the chain over the band, each reading the rows
+// of the previous one from a small ring, or the combined filter if folded
+void chainConvolution(Image *out, const Image &in, const FilterChain &chain, size_t y0, size_t y1);
+
+// Applies the filter to every color plane of the band with simdConvolution,
+// and copies the opacity. out must already have the layout of in
+// The separable decomposition is not used on planes
+void planarConvolution(PlanarImage *out, const PlanarImage &in, const Filter &filter, BorderMode border,
+                       size_t y0, size_t y1);
+
+// Uniform filters with more taps than this are cheaper as running sums than
+// with any of the kernels above, so Filter::plan only marks those as boxes
+static const size_t boxThreshold = 3 * 3;
+
+// Box filters (Filter::box) applied one after the other with running sums,
+// one horizontal and one vertical pass each, so the cost per pixel does not
+// depend on their size. First boxRows does the horizontal passes of the rows
+// [y0, y1) into sums (3 * in.width floats per row), then boxColumns does the
+// vertical ones for the columns [x0, x1), once all the rows are in
+void boxRows(Matrix<float> *sums, const Image &in, const std::vector<Filter> &boxes, BorderMode border,
+             size_t y0, size_t y1);
+void boxColumns(Image *out, const Image &in, const Matrix<float> &sums, const std::vector<Filter> &boxes,
+                BorderMode border, size_t x0, size_t x1);
+void boxRows(Matrix<float> *sums, const Image &in, const std::vector<Filter> &boxes, BorderMode border,
+             size_t y0, size_t y1, Workspace &workspace);
+void boxColumns(Image *out, const Image &in, const Matrix<float> &sums, const std::vector<Filter> &boxes,
+                BorderMode border, size_t x0, size_t x1, Workspace &workspace);
+
+// Both of the above over the whole image
+void boxConvolution(Image *out, const Image &in, const std::vector<Filter> &boxes, BorderMode border);
+
+// Filters with more taps than this are cheaper in the frequency domain
+static const size_t fftThreshold = 15 * 15;
+
+// Frequency domain implementation, for the whole image
+// Works on tiles (overlap-save), so only the tile transforms are kept in memory
+void fftConvolution(Image *out, const Image &in, const Filter &filter, BorderMode border);
+
+// fftConvolution in two steps: the transform of the filter, the border
+// tables and the buffers of a tile are prepared for one image size, then
+// apply allocates nothing
+class FftFilter
+{
+public:
+    FftFilter(const Filter &filter, size_t width, size_t height, BorderMode border);
+    ~FftFilter();
+
+    void apply(Image *out, const Image &in);
+
+private:
+    struct State;
+    std::unique_ptr<State> state;
+
+    FftFilter(const FftFilter&);
+    FftFilter& operator = (const FftFilter&);
+};
+
+// The regions cut into tiles of at most tileColumns x tileRows, for
+// tileConvolution. Empty ones are dropped
+// Throws if one does not fit in an image of width x height
+std::vector<Region> regionTiles(const std::vector<Region> &regions, size_t width, size_t height,
+                                size_t tileColumns, size_t tileRows);
+
+// Resizes out to width x height for the region overloads. A view of another
+// size would be freed and replaced, so that throws instead
+void regionOutput(Image *out, size_t width, size_t height);
+
+// Temporal blocking of convolveIterate: several iterations are applied to
+// a tile while it is in cache, each on a smaller part of it
+// Iterations to apply per tile, and rows and columns of the tiles, for images
+// of the given width. Tiles are whole rows unless the image is too wide for
+// that. 1 if the filter is better applied to the whole image
+size_t iterationBlock(const Filter &filter, size_t width, size_t *bandRows, size_t *bandColumns);
+
+// Columns [x0, x1) of the rows [y0, y1) of the filter applied `iterations`
+// times to in. Pixels around the tile are recomputed as many times as tiles
+// need them
+// bands are two images kept between calls, resized as needed
+void iterateBand(Image *out, const Image &in, const Filter &filter, BorderMode border, size_t iterations,
+                 size_t x0, size_t x1, size_t y0, size_t y1, Image *bands, Workspace &workspace);
+
+// n iterations back and forth between image and a second buffer of its size
+// pass(out, in, k) applies k of them, no more than block at once
+// The result ends up in image
+void pingPong(Image &image, unsigned n, size_t block,
+              const std::function<void(Image*, const Image&, size_t)> &pass);
+
+#endif // _KERNELS_H_
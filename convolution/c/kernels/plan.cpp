@@ -0,0 +1,146 @@
+#include <stdexcept>
+#include "kernels.h"
+
+
+void Filter::plan()
+{
+    terms.clear();
+    taps.clear();
+    fixed = FixedPointFilter();
+
+    std::vector<FilterTap> nonZero;
+    box = width * height > boxThreshold;
+    for (size_t y = 0; y < height; ++y) {
+        for (size_t x = 0; x < width; ++x) {
+            if ((*this)[y][x] != 0)
+                nonZero.push_back(FilterTap{x, y, (*this)[y][x]});
+            box = box && (*this)[y][x] == (*this)[0][0];
+        }
+    }
+
+    // Boxes get one of these too, for the paths that work a band at a time
+    // Only worth it if the passes are cheaper than the direct product, or
+    // than the non zero taps alone
+    std::vector<FilterTerm> decomposition = decompose(*this);
+    const size_t separableCost = decomposition.size() * (width + height);
+    const size_t sparseCost = nonZero.size() * sparseTapCost;
+
+    if (separableCost < width * height && separableCost <= sparseCost)
+        terms.swap(decomposition);
+    else if (sparseCost < width * height)
+        taps.swap(nonZero);
+}
+
+
+template <class P>
+void tileConvolution(Matrix<P> *out, const Matrix<P> &in, const Filter &filter, BorderMode border,
+                     size_t x0, size_t x1, size_t y0, size_t y1, Workspace &workspace)
+{
+    if (!filter.terms.empty())
+        separableConvolution(out, in, filter, border, x0, x1, y0, y1, workspace);
+    else
+        simdConvolution(out, in, filter, border, x0, x1, y0, y1, workspace);
+}
+
+
+template <class P>
+void tileConvolution(Matrix<P> *out, const Matrix<P> &in, const Filter &filter, BorderMode border,
+                     size_t x0, size_t x1, size_t y0, size_t y1)
+{
+    Workspace workspace;
+    tileConvolution(out, in, filter, border, x0, x1, y0, y1, workspace);
+}
+
+
+// For every kind of pixel
+#define INSTANTIATE(P) \
+    template void tileConvolution(Matrix<P>*, const Matrix<P>&, const Filter&, BorderMode, \
+                                  size_t, size_t, size_t, size_t); \
+    template void tileConvolution(Matrix<P>*, const Matrix<P>&, const Filter&, BorderMode, \
+                                  size_t, size_t, size_t, size_t, Workspace&);
+
+INSTANTIATE(Pixel)
+INSTANTIATE(Pixel16)
+INSTANTIATE(PixelF)
+
+
+void bandConvolution(Image *out, const Image &in, const Filter &filter, BorderMode border,
+                     size_t y0, size_t y1)
+{
+    tileConvolution(out, in, filter, border, 0, in.width, y0, y1);
+}
+
+
+struct ConvolutionPlan::State
+{
+    size_t width, height;
+    BorderMode border;
+
+    // The filter, as a list for the box kernels
+    std::vector<Filter> boxes;
+    const Filter &filter;
+
+    // Set when the filter is cheaper in the frequency domain
+    std::unique_ptr<FftFilter> fft;
+
+    // Between the passes of a box
+    Matrix<float> sums;
+    Workspace workspace;
+
+    State(const Filter &f, size_t width, size_t height, BorderMode border):
+        width(width), height(height), border(border), boxes(1, f), filter(boxes[0])
+    {
+    }
+
+    // The output rows [0, y1), or for a box the rows [0, y1) of the
+    // horizontal passes and the columns [0, x1) of the vertical ones
+    void apply(Image *out, const Image &in, size_t x1, size_t y1)
+    {
+        if (filter.box) {
+            boxRows(&sums, in, boxes, border, 0, y1, workspace);
+            boxColumns(out, in, sums, boxes, border, 0, x1, workspace);
+        }
+        else if (fft) {
+            fft->apply(out, in);
+        }
+        else {
+            tileConvolution(out, in, filter, border, 0, in.width, 0, y1, workspace);
+        }
+    }
+};
+
+
+// Same choice as the frequency domain backend, which is the widest
+ConvolutionPlan::ConvolutionPlan(const Filter &filter, size_t width, size_t height, BorderMode border):
+    state(new State(filter, width, height, border))
+{
+    const size_t taps = filter.taps.empty() ? filter.width * filter.height : filter.taps.size() * sparseTapCost;
+
+    if (filter.box)
+        state->sums.resize(3 * width, height);
+    else if (filter.terms.empty() && taps > fftThreshold && filter.fixed.coefficients.empty())
+        state->fft.reset(new FftFilter(filter, width, height, border));
+
+    // A first run over a single row (or column) on a blank image grows the
+    // scratch buffers to what execute needs
+    if (width > 0 && height > 0 && !state->fft) {
+        Image blank(width, height), out(width, height);
+        state->apply(&out, blank, 1, 1);
+    }
+}
+
+
+ConvolutionPlan::~ConvolutionPlan()
+{
+}
+
+
+void ConvolutionPlan::execute(Image *out, const Image &in)
+{
+    if (in.width != state->width || in.height != state->height)
+        throw std::runtime_error("The image does not have the size the plan was made for");
+
+    out->resize(in.width, in.height);
+    if (in.width > 0 && in.height > 0)
+        state->apply(out, in, in.width, in.height);
+}
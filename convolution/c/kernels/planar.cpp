@@ -0,0 +1,14 @@
+#include <algorithm>
+#include "kernels.h"
+
+
+void planarConvolution(PlanarImage *out, const PlanarImage &in, const Filter &filter, BorderMode border,
+                       size_t y0, size_t y1)
+{
+    for (size_t c = 0; c < in.colors.size(); ++c)
+        simdConvolution(&out->colors[c], in.colors[c], filter, border, y0, y1);
+
+    if (!in.opaque())
+        for (size_t y = y0; y < y1; ++y)
+            std::copy(in.opacity.row(y), in.opacity.row(y) + in.width, out->opacity.row(y));
+}
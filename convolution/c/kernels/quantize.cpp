@@ -0,0 +1,46 @@
+#include <cmath>
+#include <stdexcept>
+#include "kernels.h"
+
+
+void Filter::quantize()
+{
+    const size_t n = width * height;
+
+    // Row by row, the rows are padded
+    double largest = 0, sum = 0;
+    for (size_t y = 0; y < height; ++y) {
+        for (size_t x = 0; x < width; ++x) {
+            largest = std::max(largest, std::fabs((*this)[y][x]));
+            sum += std::fabs((*this)[y][x]);
+        }
+    }
+
+    // Largest shift that keeps every coefficient within 16 bits, and any sum
+    // of products with 8 bit pixels within 32
+    unsigned shift = 30;
+    while (shift > 0 && (std::round(std::ldexp(largest, shift)) > INT16_MAX ||
+                         255 * (std::ldexp(sum, shift) + n / 2.0) > INT32_MAX))
+        --shift;
+    if (std::round(largest) > INT16_MAX || 255 * (sum + n / 2.0) > INT32_MAX)
+        throw std::runtime_error("The filter coefficients are too large for fixed point");
+
+    fixed.shift = shift;
+    fixed.coefficients.resize(n);
+    fixed.errorBound = 0;
+    for (size_t y = 0; y < height; ++y) {
+        for (size_t x = 0; x < width; ++x) {
+            const double c = (*this)[y][x];
+            const double scaled = std::round(std::ldexp(c, shift));
+            if (scaled > INT16_MAX || scaled < INT16_MIN)
+                throw std::runtime_error("A filter coefficient does not fit in 16 bit fixed point");
+            const int16_t q = static_cast<int16_t>(scaled);
+            fixed.coefficients[y * width + x] = q;
+            fixed.errorBound += 255 * std::fabs(c - std::ldexp(q, -static_cast<int>(shift)));
+        }
+    }
+
+    // The separable passes and the running sums stay in floating point
+    terms.clear();
+    box = false;
+}
@@ -0,0 +1,31 @@
+#include <algorithm>
+#include <stdexcept>
+#include "kernels.h"
+
+
+std::vector<Region> regionTiles(const std::vector<Region> &regions, size_t width, size_t height,
+                                size_t tileColumns, size_t tileRows)
+{
+    std::vector<Region> tiles;
+
+    for (size_t i = 0; i < regions.size(); ++i) {
+        const Region &r = regions[i];
+        if (r.x > width || r.width > width - r.x || r.y > height || r.height > height - r.y)
+            throw std::runtime_error("Region out of the image");
+
+        for (size_t y = r.y; y < r.y + r.height; y += tileRows)
+            for (size_t x = r.x; x < r.x + r.width; x += tileColumns)
+                tiles.push_back(Region{x, y, std::min(tileColumns, r.x + r.width - x),
+                                       std::min(tileRows, r.y + r.height - y)});
+    }
+
+    return tiles;
+}
+
+
+void regionOutput(Image *out, size_t width, size_t height)
+{
+    if (!out->owner() && (out->width != width || out->height != height))
+        throw std::runtime_error("The output view is not the size of the image");
+    out->resize(width, height);
+}
@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <cmath>
+#include "kernels.h"
+
+
+// Singular values below this fraction of the largest one are dropped
+static const double rankTolerance = 1e-10;
+
+// Maximum number of Jacobi sweeps
+static const int maxSweeps = 64;
+
+
+// One-sided Jacobi SVD
+// On return u holds the columns U * S, and v the right singular vectors,
+// so m = u * v^T
+static void jacobi(Matrix<double> &u, Matrix<double> &v)
+{
+    const size_t rows = u.height, cols = u.width;
+
+    for (size_t i = 0; i < cols; ++i)
+        for (size_t j = 0; j < cols; ++j)
+            v[i][j] = (i == j) ? 1 : 0;
+
+    for (int sweep = 0; sweep < maxSweeps; ++sweep) {
+        bool rotated = false;
+
+        for (size_t p = 0; p + 1 < cols; ++p) {
+            for (size_t q = p + 1; q < cols; ++q) {
+                double alpha = 0, beta = 0, gamma = 0;
+                for (size_t i = 0; i < rows; ++i) {
+                    alpha += u[i][p] * u[i][p];
+                    beta  += u[i][q] * u[i][q];
+                    gamma += u[i][p] * u[i][q];
+                }
+
+                if (gamma == 0 || std::fabs(gamma) <= 1e-15 * std::sqrt(alpha * beta))
+                    continue;
+                rotated = true;
+
+                double zeta = (beta - alpha) / (2 * gamma);
+                double t = (zeta >= 0 ? 1 : -1) / (std::fabs(zeta) + std::sqrt(1 + zeta * zeta));
+                double c = 1 / std::sqrt(1 + t * t);
+                double s = c * t;
+
+                for (size_t i = 0; i < rows; ++i) {
+                    double up = u[i][p], uq = u[i][q];
+                    u[i][p] = c * up - s * uq;
+                    u[i][q] = s * up + c * uq;
+                }
+                for (size_t i = 0; i < cols; ++i) {
+                    double vp = v[i][p], vq = v[i][q];
+                    v[i][p] = c * vp - s * vq;
+                    v[i][q] = s * vp + c * vq;
+                }
+            }
+        }
+
+        if (!rotated)
+            break;
+    }
+}
+
+
+std::vector<FilterTerm> decompose(const Matrix<double> &m)
+{
+    std::vector<FilterTerm> terms;
+    if (m.width == 0 || m.height == 0)
+        return terms;
+
+    Matrix<double> u(m), v(m.width);
+    jacobi(u, v);
+
+    // Singular values, largest first
+    std::vector<std::pair<double, size_t> > sigma(m.width);
+    for (size_t j = 0; j < m.width; ++j) {
+        double norm = 0;
+        for (size_t i = 0; i < m.height; ++i)
+            norm += u[i][j] * u[i][j];
+        sigma[j] = std::make_pair(std::sqrt(norm), j);
+    }
+    std::sort(sigma.rbegin(), sigma.rend());
+
+    for (size_t k = 0; k < sigma.size(); ++k) {
+        if (sigma[k].first <= rankTolerance * sigma[0].first || sigma[k].first == 0)
+            break;
+
+        size_t j = sigma[k].second;
+        FilterTerm term;
+        term.column.resize(m.height);
+        term.row.resize(m.width);
+        for (size_t i = 0; i < m.height; ++i)
+            term.column[i] = u[i][j];
+        for (size_t i = 0; i < m.width; ++i)
+            term.row[i] = v[i][j];
+        terms.push_back(term);
+    }
+
+    return terms;
+}
+
+
+template <class P>
+void separableConvolution(Matrix<P> *out, const Matrix<P> &in, const Filter &filter, BorderMode border,
+                          size_t x0, size_t x1, size_t y0, size_t y1, Workspace &workspace)
+{
+    if (x0 >= x1 || y0 >= y1)
+        return;
+
+    const size_t nTerms = filter.terms.size();
+    const std::vector<ptrdiff_t> &columns = workspace.table(0, in.width, filter.width, border);
+    const std::vector<ptrdiff_t> &rows = workspace.table(1, in.height, filter.height, border);
+
+    // The columns [x0, x1) are processed in tiles, so the rings of all the
+    // terms stay in cache
+    const size_t tile = tileWidth(3 * sizeof(double) * filter.height * nTerms, 0, 1);
+
+    // For each term, a ring with the last filter.height horizontal passes
+    // (three interleaved channels per pixel), one after the other
+    Matrix<double> rings = workspace.matrix<double>(0, 3 * std::min(tile, x1 - x0), filter.height * nTerms);
+    double *accum = workspace.buffer<double>(1, 3 * std::min(tile, x1 - x0));
+
+    for (size_t t0 = x0; t0 < x1; t0 += tile) {
+        const size_t t1 = std::min(x1, t0 + tile);
+        const size_t n = 3 * (t1 - t0);
+
+        // The horizontal pass of the source row for rows[y0 + i] lives in the
+        // slot i % filter.height
+        for (size_t i = 0; i < filter.height + (y1 - y0) - 1; ++i) {
+            const ptrdiff_t imageY = rows[y0 + i];
+            for (size_t t = 0; t < nTerms; ++t) {
+                double *pass = rings.row(t * filter.height + i % filter.height);
+                std::fill(pass, pass + n, 0);
+                if (imageY >= 0)
+                    accumulateRow(pass, in.row(imageY), in.width,
+                                  filter.terms[t].row.data(), filter.width, columns, t0, t1);
+            }
+
+            if (i + 1 < filter.height)
+                continue;
+
+            // All the passes for the output row y are in
+            const size_t y = y0 + i - (filter.height - 1);
+
+            // Vertical pass
+            std::fill(accum, accum + n, 0);
+            for (size_t t = 0; t < nTerms; ++t) {
+                const std::vector<double> &column = filter.terms[t].column;
+
+                for (size_t filterY = 0; filterY < filter.height; ++filterY) {
+                    const double *tmp = rings.row(t * filter.height + (y - y0 + filterY) % filter.height);
+                    const double  c   = column[filterY];
+
+                    for (size_t j = 0; j < n; ++j)
+                        accum[j] += tmp[j] * c;
+                }
+            }
+
+            // truncate values smaller than 0 and larger than 255
+            typedef typename P::Channel Channel;
+            const P *inRow  = in.row(y);
+            P       *outRow = out->row(y);
+            for (size_t x = t0; x < t1; ++x) {
+                const double *a = &accum[3 * (x - t0)];
+                outRow[x].r = toChannel<Channel>(a[0]);
+                outRow[x].g = toChannel<Channel>(a[1]);
+                outRow[x].b = toChannel<Channel>(a[2]);
+                outRow[x].a = inRow[x].a;
+            }
+        }
+    }
+}
+
+
+template <class P>
+void separableConvolution(Matrix<P> *out, const Matrix<P> &in, const Filter &filter, BorderMode border,
+                          size_t x0, size_t x1, size_t y0, size_t y1)
+{
+    Workspace workspace;
+    separableConvolution(out, in, filter, border, x0, x1, y0, y1, workspace);
+}
+
+
+// For every kind of pixel
+#define INSTANTIATE(P) \
+    template void separableConvolution(Matrix<P>*, const Matrix<P>&, const Filter&, BorderMode, \
+                                       size_t, size_t, size_t, size_t); \
+    template void separableConvolution(Matrix<P>*, const Matrix<P>&, const Filter&, BorderMode, \
+                                       size_t, size_t, size_t, size_t, Workspace&);
+
+INSTANTIATE(Pixel)
+INSTANTIATE(Pixel16)
+INSTANTIATE(PixelF)
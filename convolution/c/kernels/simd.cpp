@@ -0,0 +1,519 @@
+#include <algorithm>
+#include <limits>
+#include "kernels.h"
+
+
+// Widest vector, in 32 bit values, any of the implementations use
+static const size_t maxLanes = 16;
+
+
+// Largest value of a channel, which results are clamped to; 0 for float
+// ones, which are not clamped
+template <class Channel>
+struct ChannelTop
+{
+    static const int value = 0;
+};
+
+template <>
+struct ChannelTop<uint8_t>
+{
+    static const int value = 255;
+};
+
+template <>
+struct ChannelTop<uint16_t>
+{
+    static const int value = 65535;
+};
+
+
+// How vectorConvolution reads and writes the pixels of each kind of image
+// Interleaved pixels: the three color channels are filtered, the opacity
+// copied. Only 8 bit ones take fixed point coefficients, the sums of wider
+// ones would not fit in 32 bits
+template <class Channel>
+struct PixelLayout
+{
+    typedef BasicPixel<Channel> Value;
+    static const size_t channels = 3;
+    static const int top = ChannelTop<Channel>::value;
+    static const bool fixedPoint = top == 255;
+
+    template <class T>
+    static inline __attribute__((always_inline))
+    void load(T *plane, size_t span, size_t u, const Value &p)
+    {
+        plane[u]            = p.r;
+        plane[span + u]     = p.g;
+        plane[2 * span + u] = p.b;
+    }
+
+    template <class T>
+    static inline __attribute__((always_inline))
+    void store(Value *outRow, const Value *inRow, const Matrix<T> &result, size_t x0, size_t x1)
+    {
+        for (size_t x = x0; x < x1; ++x) {
+            outRow[x].r = static_cast<Channel>(result[0][x - x0]);
+            outRow[x].g = static_cast<Channel>(result[1][x - x0]);
+            outRow[x].b = static_cast<Channel>(result[2][x - x0]);
+            outRow[x].a = inRow[x].a;
+        }
+    }
+};
+
+// A single channel plane, as in PlanarImage
+struct PlaneLayout
+{
+    typedef uint8_t Value;
+    static const size_t channels = 1;
+    static const int top = 255;
+    static const bool fixedPoint = true;
+
+    template <class T>
+    static inline __attribute__((always_inline))
+    void load(T *plane, size_t, size_t u, uint8_t p)
+    {
+        plane[u] = p;
+    }
+
+    template <class T>
+    static inline __attribute__((always_inline))
+    void store(uint8_t *outRow, const uint8_t *, const Matrix<T> &result, size_t x0, size_t x1)
+    {
+        for (size_t x = x0; x < x1; ++x)
+            outRow[x] = static_cast<int>(result[0][x - x0]);
+    }
+};
+
+
+// Positions [u0, u1) of a row converted to one plane per channel, span
+// apart, reading the pixels through the border table
+template <class Layout, class T>
+static inline __attribute__((always_inline))
+void edgeColumns(T *plane, size_t span, const typename Layout::Value *src, const ptrdiff_t *columns,
+                 size_t u0, size_t u1)
+{
+    for (size_t u = u0; u < u1; ++u) {
+        const ptrdiff_t imageX = columns[u];
+        if (imageX >= 0) {
+            Layout::load(plane, span, u, src[imageX]);
+            continue;
+        }
+        for (size_t c = 0; c < Layout::channels; ++c)
+            plane[c * span + u] = 0;
+    }
+}
+
+
+// Vectors of output pixels computed together by vectorConvolution
+static const size_t unroll = 4;
+
+
+// Sums back to pixel levels: fixed point ones are shifted, floating point
+// ones already are
+template <class Vector>
+static inline __attribute__((always_inline))
+void descale(Vector &, unsigned, float)
+{
+}
+
+template <class Vector>
+static inline __attribute__((always_inline))
+void descale(Vector &v, unsigned shift, int32_t)
+{
+    v >>= shift;
+}
+
+
+// Clamps U vectors of V output pixels, for each of the C channels, to
+// [0, Top] (unless Top is 0) and stores them into result, from x on
+template <class T, size_t V, size_t U, size_t C, int Top, class Vector>
+static inline __attribute__((always_inline))
+void storeClamped(Matrix<T> &result, Vector (*sums)[U], unsigned shift, size_t x)
+{
+    // truncate values smaller than 0 and larger than Top
+    const Vector zero = {}, top = zero + Top;
+    for (size_t c = 0; c < C; ++c) {
+        for (size_t u = 0; u < U; ++u) {
+            Vector &v = sums[c][u];
+            descale(v, shift, T());
+            if (Top)
+                v = v < zero ? zero : (v > top ? top : v);
+            __builtin_memcpy(result.row(c) + x + u * V, &v, sizeof(Vector));
+        }
+    }
+}
+
+
+// U vectors of V output pixels of C channels, from x on, into result
+// The filter rows are read from planes, span values per channel
+template <class T, size_t V, size_t U, size_t C, int Top, size_t KW, size_t KH>
+static inline __attribute__((always_inline))
+void vectorTaps(Matrix<T> &result, const T *const *planes, size_t span,
+                const T *coefficients, size_t kw, size_t kh, unsigned shift, size_t x)
+{
+    typedef T Vector __attribute__((vector_size(V * sizeof(T))));
+
+    Vector sums[C][U];
+    for (size_t c = 0; c < C; ++c)
+        for (size_t u = 0; u < U; ++u)
+            sums[c][u] = Vector{};
+
+    for (size_t filterY = 0; filterY < (KH ? KH : kh); ++filterY) {
+        const T *src = planes[filterY] + x;
+        const T *k   = coefficients + filterY * (KW ? KW : kw);
+
+        for (size_t filterX = 0; filterX < (KW ? KW : kw); ++filterX) {
+            const Vector weight = Vector{} + k[filterX];
+            for (size_t c = 0; c < C; ++c) {
+                for (size_t u = 0; u < U; ++u) {
+                    Vector v;
+                    __builtin_memcpy(&v, src + c * span + u * V + filterX, sizeof(Vector));
+                    sums[c][u] += v * weight;
+                }
+            }
+        }
+    }
+
+    storeClamped<T, V, U, C, Top>(result, sums, shift, x);
+}
+
+
+// Same as vectorTaps, for the n non zero taps of a sparse filter only
+template <class T, size_t V, size_t U, size_t C, int Top>
+static inline __attribute__((always_inline))
+void vectorSparseTaps(Matrix<T> &result, const T *const *planes, size_t span,
+                      const FilterTap *taps, const T *weights, size_t n, unsigned shift, size_t x)
+{
+    typedef T Vector __attribute__((vector_size(V * sizeof(T))));
+
+    Vector sums[C][U];
+    for (size_t c = 0; c < C; ++c)
+        for (size_t u = 0; u < U; ++u)
+            sums[c][u] = Vector{};
+
+    for (size_t i = 0; i < n; ++i) {
+        const T *src = planes[taps[i].dy] + x + taps[i].dx;
+        const Vector weight = Vector{} + weights[i];
+        for (size_t c = 0; c < C; ++c) {
+            for (size_t u = 0; u < U; ++u) {
+                Vector v;
+                __builtin_memcpy(&v, src + c * span + u * V, sizeof(Vector));
+                sums[c][u] += v * weight;
+            }
+        }
+    }
+
+    storeClamped<T, V, U, C, Top>(result, sums, shift, x);
+}
+
+
+// Vectorized band kernel, V output pixels per iteration
+// Generic code on GCC vector types, inlined into the per-ISA entry points
+// below so each one is compiled for its own instruction set
+// A non zero KW x KH fixes the filter size at compile time, so the loops
+// over the taps unroll and the coefficients stay in registers
+// T is float, or int32_t for the fixed point coefficients (Filter::fixed)
+template <class Layout, class T, size_t V, size_t KW, size_t KH>
+static inline __attribute__((always_inline))
+void vectorConvolution(Matrix<typename Layout::Value> *out, const Matrix<typename Layout::Value> &in,
+                       const Filter &filter, BorderMode border, size_t x0, size_t x1, size_t y0, size_t y1,
+                       Workspace &workspace)
+{
+    typedef typename Layout::Value Value;
+    const size_t C = Layout::channels;
+    const int Top = Layout::top;
+
+    const size_t width = in.width;
+    const size_t kw = KW ? KW : filter.width, kh = KH ? KH : filter.height;
+    const std::vector<ptrdiff_t> &columns = workspace.table(0, in.width, kw, border);
+    const std::vector<ptrdiff_t> &rows = workspace.table(1, in.height, kh, border);
+
+    const std::vector<int16_t> &fixed = filter.fixed.coefficients;
+    const unsigned shift = filter.fixed.shift;
+
+    T *coefficients = workspace.buffer<T>(0, kw * kh);
+    for (size_t filterY = 0; filterY < kh; ++filterY)
+        for (size_t filterX = 0; filterX < kw; ++filterX)
+            coefficients[filterY * kw + filterX] = std::numeric_limits<T>::is_integer
+                                                   ? fixed[filterY * kw + filterX] : filter[filterY][filterX];
+
+    // Sparse filters only go through their non zero taps
+    const std::vector<FilterTap> &taps = filter.taps;
+    T *weights = workspace.buffer<T>(1, taps.size());
+    for (size_t i = 0; i < taps.size(); ++i)
+        weights[i] = coefficients[taps[i].dy * kw + taps[i].dx];
+
+    // The columns [x0, x1) are processed in tiles, sized so the ring of
+    // input rows stays in cache
+    const size_t tile = std::min(tileWidth(C * sizeof(T) * kh, kw - 1, maxLanes),
+                                 (x1 - x0 + maxLanes - 1) / maxLanes * maxLanes);
+
+    // Every input row of the tile (with its halo) is converted once to one
+    // plane per channel, with the horizontal border already applied and long
+    // enough to read whole vectors past the end
+    const size_t span = tile + kw - 1;
+
+    Matrix<T> ring = workspace.matrix<T>(2, C * span, kh);
+    Matrix<T> result = workspace.matrix<T>(3, tile, C);
+    const T **planes = workspace.buffer<const T*>(4, kh);
+
+    for (size_t t0 = x0; t0 < x1; t0 += tile) {
+        const size_t t1 = std::min(x1, t0 + tile);
+        const size_t padded = (t1 - t0 + V - 1) / V * V;
+        const size_t used = std::min(span, columns.size() - t0);
+
+        // Positions [interiorBegin, interiorEnd) of the span are read straight
+        // from the row, only the ones past the edges go through the table
+        const size_t half = kw / 2;
+        const size_t interiorBegin = std::min(used, (t0 < half) ? half - t0 : 0);
+        const size_t interiorEnd = std::max(interiorBegin, std::min(used, width + half - t0));
+
+        // The source row rows[y0 + i] is kept in the slot i % kh
+        for (size_t i = 0; i < kh + (y1 - y0) - 1; ++i) {
+            const ptrdiff_t imageY = rows[y0 + i];
+            T *plane = ring.row(i % kh);
+
+            if (imageY < 0) {
+                std::fill(plane, plane + C * span, 0);
+            }
+            else {
+                const Value *src = in.row(imageY);
+                const Value *p = src + t0 - half;
+                edgeColumns<Layout>(plane, span, src, columns.data() + t0, 0, interiorBegin);
+                for (size_t u = interiorBegin; u < interiorEnd; ++u)
+                    Layout::load(plane, span, u, p[u]);
+                edgeColumns<Layout>(plane, span, src, columns.data() + t0, interiorEnd, used);
+                for (size_t c = 0; c < C; ++c)
+                    std::fill(plane + c * span + used, plane + (c + 1) * span, 0);
+            }
+
+            if (i + 1 < kh)
+                continue;
+
+            // All the rows for the output row y are in
+            const size_t y = y0 + i - (kh - 1);
+            for (size_t filterY = 0; filterY < kh; ++filterY)
+                planes[filterY] = ring.row((y - y0 + filterY) % kh);
+
+            // Several vectors at a time while they fit, so the multiply-adds
+            // of each do not wait on the previous ones
+            size_t x = 0;
+            if (!KW && !taps.empty()) {
+                for (; x + unroll * V <= padded; x += unroll * V)
+                    vectorSparseTaps<T, V, unroll, C, Top>(result, planes, span, taps.data(),
+                                                      weights, taps.size(), shift, x);
+                for (; x < padded; x += V)
+                    vectorSparseTaps<T, V, 1, C, Top>(result, planes, span, taps.data(),
+                                                 weights, taps.size(), shift, x);
+            }
+            else {
+                for (; x + unroll * V <= padded; x += unroll * V)
+                    vectorTaps<T, V, unroll, C, Top, KW, KH>(result, planes, span, coefficients,
+                                                        kw, kh, shift, x);
+                for (; x < padded; x += V)
+                    vectorTaps<T, V, 1, C, Top, KW, KH>(result, planes, span, coefficients,
+                                                   kw, kh, shift, x);
+            }
+
+            // Already clamped
+            Layout::store(out->row(y), in.row(y), result, t0, t1);
+        }
+    }
+}
+
+
+// Picks the specialization for the size of the filter, if there is one
+// Sparse and fixed point filters always take the generic one
+template <class Layout, size_t V>
+static inline __attribute__((always_inline))
+void convolve(Matrix<typename Layout::Value> *out, const Matrix<typename Layout::Value> &in,
+              const Filter &filter, BorderMode border, size_t x0, size_t x1, size_t y0, size_t y1,
+              Workspace &workspace)
+{
+    if (!filter.fixed.coefficients.empty() && Layout::fixedPoint)
+        vectorConvolution<Layout, int32_t, V, 0, 0>(out, in, filter, border, x0, x1, y0, y1, workspace);
+    else if (!filter.taps.empty())
+        vectorConvolution<Layout, float, V, 0, 0>(out, in, filter, border, x0, x1, y0, y1, workspace);
+    else if (filter.width == 3 && filter.height == 3)
+        vectorConvolution<Layout, float, V, 3, 3>(out, in, filter, border, x0, x1, y0, y1, workspace);
+    else if (filter.width == 5 && filter.height == 5)
+        vectorConvolution<Layout, float, V, 5, 5>(out, in, filter, border, x0, x1, y0, y1, workspace);
+    else if (filter.width == 7 && filter.height == 7)
+        vectorConvolution<Layout, float, V, 7, 7>(out, in, filter, border, x0, x1, y0, y1, workspace);
+    else
+        vectorConvolution<Layout, float, V, 0, 0>(out, in, filter, border, x0, x1, y0, y1, workspace);
+}
+
+
+template <class P>
+using TileKernel = void (*)(Matrix<P>*, const Matrix<P>&, const Filter&, BorderMode, size_t, size_t, size_t, size_t,
+                            Workspace&);
+typedef void (*PlaneKernel)(Plane*, const Plane&, const Filter&, BorderMode, size_t, size_t, Workspace&);
+
+#if defined(__x86_64__) || defined(__i386__)
+
+template <class Channel>
+__attribute__((target("avx512f")))
+static void avx512Convolution(Matrix<BasicPixel<Channel> > *out, const Matrix<BasicPixel<Channel> > &in,
+                              const Filter &filter, BorderMode border, size_t x0, size_t x1, size_t y0, size_t y1,
+                              Workspace &workspace)
+{
+    convolve<PixelLayout<Channel>, 16>(out, in, filter, border, x0, x1, y0, y1, workspace);
+}
+
+__attribute__((target("avx512f")))
+static void avx512PlaneConvolution(Plane *out, const Plane &in, const Filter &filter, BorderMode border,
+                                   size_t y0, size_t y1, Workspace &workspace)
+{
+    convolve<PlaneLayout, 16>(out, in, filter, border, 0, in.width, y0, y1, workspace);
+}
+
+template <class Channel>
+__attribute__((target("avx2")))
+static void avx2Convolution(Matrix<BasicPixel<Channel> > *out, const Matrix<BasicPixel<Channel> > &in,
+                            const Filter &filter, BorderMode border, size_t x0, size_t x1, size_t y0, size_t y1,
+                            Workspace &workspace)
+{
+    convolve<PixelLayout<Channel>, 8>(out, in, filter, border, x0, x1, y0, y1, workspace);
+}
+
+__attribute__((target("avx2")))
+static void avx2PlaneConvolution(Plane *out, const Plane &in, const Filter &filter, BorderMode border,
+                                 size_t y0, size_t y1, Workspace &workspace)
+{
+    convolve<PlaneLayout, 8>(out, in, filter, border, 0, in.width, y0, y1, workspace);
+}
+
+template <class Channel>
+__attribute__((target("sse2")))
+static void sse2Convolution(Matrix<BasicPixel<Channel> > *out, const Matrix<BasicPixel<Channel> > &in,
+                            const Filter &filter, BorderMode border, size_t x0, size_t x1, size_t y0, size_t y1,
+                            Workspace &workspace)
+{
+    convolve<PixelLayout<Channel>, 4>(out, in, filter, border, x0, x1, y0, y1, workspace);
+}
+
+__attribute__((target("sse2")))
+static void sse2PlaneConvolution(Plane *out, const Plane &in, const Filter &filter, BorderMode border,
+                                 size_t y0, size_t y1, Workspace &workspace)
+{
+    convolve<PlaneLayout, 4>(out, in, filter, border, 0, in.width, y0, y1, workspace);
+}
+
+#endif
+
+// Planes have no double precision kernel to fall back to, one lane vectors
+// are used instead
+static void scalarPlaneConvolution(Plane *out, const Plane &in, const Filter &filter, BorderMode border,
+                                   size_t y0, size_t y1, Workspace &workspace)
+{
+    convolve<PlaneLayout, 1>(out, in, filter, border, 0, in.width, y0, y1, workspace);
+}
+
+
+struct SimdImplementation
+{
+    const char *name;
+    TileKernel<Pixel>   kernel;
+    TileKernel<Pixel16> kernel16;
+    TileKernel<PixelF>  kernelF;
+    PlaneKernel planeKernel;
+};
+
+
+// Picks the widest implementation the CPU supports
+static SimdImplementation selectImplementation()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return SimdImplementation{"avx512f", avx512Convolution<uint8_t>, avx512Convolution<uint16_t>,
+                                  avx512Convolution<float>, avx512PlaneConvolution};
+    if (__builtin_cpu_supports("avx2"))
+        return SimdImplementation{"avx2", avx2Convolution<uint8_t>, avx2Convolution<uint16_t>,
+                                  avx2Convolution<float>, avx2PlaneConvolution};
+    if (__builtin_cpu_supports("sse2"))
+        return SimdImplementation{"sse2", sse2Convolution<uint8_t>, sse2Convolution<uint16_t>,
+                                  sse2Convolution<float>, sse2PlaneConvolution};
+#endif
+    return SimdImplementation{"scalar", directConvolution<Pixel>, directConvolution<Pixel16>,
+                              directConvolution<PixelF>, scalarPlaneConvolution};
+}
+
+
+static const SimdImplementation& implementation()
+{
+    static const SimdImplementation selected = selectImplementation();
+    return selected;
+}
+
+
+const char* simdName()
+{
+    return implementation().name;
+}
+
+
+// The kernel of the selected implementation for each kind of pixel
+static TileKernel<Pixel> tileKernel(const Pixel*)
+{
+    return implementation().kernel;
+}
+
+static TileKernel<Pixel16> tileKernel(const Pixel16*)
+{
+    return implementation().kernel16;
+}
+
+static TileKernel<PixelF> tileKernel(const PixelF*)
+{
+    return implementation().kernelF;
+}
+
+
+template <class P>
+void simdConvolution(Matrix<P> *out, const Matrix<P> &in, const Filter &filter, BorderMode border,
+                     size_t x0, size_t x1, size_t y0, size_t y1, Workspace &workspace)
+{
+    if (filter.width == 0 || filter.height == 0)
+        directConvolution(out, in, filter, border, x0, x1, y0, y1, workspace);
+    else if (x0 < x1 && y0 < y1)
+        tileKernel(in.values)(out, in, filter, border, x0, x1, y0, y1, workspace);
+}
+
+
+template <class P>
+void simdConvolution(Matrix<P> *out, const Matrix<P> &in, const Filter &filter, BorderMode border,
+                     size_t x0, size_t x1, size_t y0, size_t y1)
+{
+    Workspace workspace;
+    simdConvolution(out, in, filter, border, x0, x1, y0, y1, workspace);
+}
+
+
+void simdConvolution(Plane *out, const Plane &in, const Filter &filter, BorderMode border,
+                     size_t y0, size_t y1)
+{
+    if (filter.width == 0 || filter.height == 0) {
+        for (size_t y = y0; y < y1; ++y)
+            std::fill(out->row(y), out->row(y) + out->width, 0);
+    }
+    else if (y0 < y1) {
+        Workspace workspace;
+        implementation().planeKernel(out, in, filter, border, y0, y1, workspace);
+    }
+}
+
+
+// For every kind of pixel
+#define INSTANTIATE(P) \
+    template void simdConvolution(Matrix<P>*, const Matrix<P>&, const Filter&, BorderMode, \
+                                  size_t, size_t, size_t, size_t); \
+    template void simdConvolution(Matrix<P>*, const Matrix<P>&, const Filter&, BorderMode, \
+                                  size_t, size_t, size_t, size_t, Workspace&);
+
+INSTANTIATE(Pixel)
+INSTANTIATE(Pixel16)
+INSTANTIATE(PixelF)
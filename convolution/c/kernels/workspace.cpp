@@ -0,0 +1,29 @@
+#include "kernels.h"
+
+
+const std::vector<ptrdiff_t>& Workspace::table(size_t slot, size_t size, size_t filterSize, BorderMode border)
+{
+    while (tables.size() <= slot)
+        tables.push_back(Table{0, 0, BorderWrap, std::vector<ptrdiff_t>()});
+
+    Table &t = tables[slot];
+    if (t.entries.empty() || t.size != size || t.filterSize != filterSize || t.border != border) {
+        t.size = size;
+        t.filterSize = filterSize;
+        t.border = border;
+        t.entries = borderTable(size, filterSize, border);
+    }
+    return t.entries;
+}
+
+
+uint8_t* Workspace::bytes(size_t slot, size_t n)
+{
+    while (buffers.size() <= slot)
+        buffers.push_back(Matrix<uint8_t>());
+
+    Matrix<uint8_t> &b = buffers[slot];
+    if (b.width < n)
+        b.resize(n, 1);
+    return b.values;
+}
@@ -1,42 +1,169 @@
+#include <algorithm>
 #include <omp.h>
 #include "../convolution.h"
+#include "../kernels/kernels.h"
+#ifdef HAVE_NUMA
+#include "nodes.h"
+#endif
+#include "processes.h"
 
 
-static uint8_t truncate(double v)
+static const size_t bandHeight = 64;
+// Columns each thread takes at once for the vertical passes of the boxes
+static const size_t stripWidth = 64;
+
+
+// Both sides of boxConvolution, rows in bands and then columns in strips
+static void parallelBoxConvolution(Image *__restrict__ out, const Image &__restrict__ in,
+                                   const std::vector<Filter> &boxes, BorderMode border)
+{
+    Matrix<float> sums(3 * in.width, in.height);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t y = 0; y < in.height; y += bandHeight) {
+        boxRows(&sums, in, boxes, border, y, std::min(in.height, y + bandHeight));
+    }
+
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t x = 0; x < in.width; x += stripWidth) {
+        boxColumns(out, in, sums, boxes, border, x, std::min(in.width, x + stripWidth));
+    }
+}
+
+
+// OpenMP implementation
+void convolution(Image *__restrict__ out, const Image &__restrict__ in, const Filter &__restrict__ filter,
+                 BorderMode border)
+{
+    // Bands on worker processes instead of threads
+    if (processCount() > 0 && !filter.box) {
+        processConvolution(out, in, filter, border, processCount());
+        return;
+    }
+
+#ifdef HAVE_NUMA
+    // Leaves the allocation of the output to the nodes
+    if (numaMode() && !filter.box) {
+        numaConvolution(out, in, filter, border);
+        return;
+    }
+#endif
+
+    out->resize(in.width, in.height);
+
+    if (filter.box) {
+        parallelBoxConvolution(out, in, std::vector<Filter>(1, filter), border);
+        return;
+    }
+
+    // Bands of rows, so the setup of each kernel (border tables, rings of
+    // rows) is paid once per band
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t y = 0; y < in.height; y += bandHeight) {
+        bandConvolution(out, in, filter, border, y, std::min(in.height, y + bandHeight));
+    }
+}
+
+
+// Wider pixels have no running sums (nor NUMA mode), boxes go through
+// tileConvolution
+template <class P>
+static void wideConvolution(Matrix<P> *__restrict__ out, const Matrix<P> &__restrict__ in,
+                            const Filter &__restrict__ filter, BorderMode border)
+{
+    out->resize(in.width, in.height);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t y = 0; y < in.height; y += bandHeight) {
+        tileConvolution(out, in, filter, border, 0, in.width, y, std::min(in.height, y + bandHeight));
+    }
+}
+
+
+void convolution(Image16 *__restrict__ out, const Image16 &__restrict__ in, const Filter &__restrict__ filter,
+                 BorderMode border)
 {
-    int vi = static_cast<int>(v);
-    if (vi < 0)   vi = 0;
-    if (vi > 255) vi = 255;
+    wideConvolution(out, in, filter, border);
+}
 
-    return static_cast<uint8_t>(vi);
+
+void convolution(ImageF *__restrict__ out, const ImageF &__restrict__ in, const Filter &__restrict__ filter,
+                 BorderMode border)
+{
+    wideConvolution(out, in, filter, border);
 }
 
-// Serial implementation
-// Adapted from http://lodev.org/cgtutor/filtering.html
-void convolution(Image *__restrict__ out, const Image &__restrict__ in, const Filter &__restrict__ filter)
+
+void convolution(Image *__restrict__ out, const Image &__restrict__ in, const FilterChain &chain)
 {
     out->resize(in.width, in.height);
 
-    #pragma omp parallel for
-    for (size_t y = 0; y < in.height; ++y) {
-        for (size_t x = 0; x < in.width; ++x) {
-            double red = 0, green = 0, blue = 0;
-
-            for (size_t filterY = 0; filterY < filter.height; ++filterY) {
-                for (size_t filterX = 0; filterX < filter.width; ++filterX) {
-                    size_t imageX = (x - filter.width / 2 + filterX + in.width) % in.width;
-                    size_t imageY = (y - filter.height / 2 + filterY + in.height) % in.height;
-
-                    red   += in.values[imageY][imageX].r * filter.values[filterY][filterX];
-                    green += in.values[imageY][imageX].g * filter.values[filterY][filterX];
-                    blue  += in.values[imageY][imageX].b * filter.values[filterY][filterX];
-                }
-            }
-            // truncate values smaller than 0 and larger than 255
-            out->values[y][x].r = truncate(red);
-            out->values[y][x].g = truncate(green);
-            out->values[y][x].b = truncate(blue);
-            out->values[y][x].a = in.values[y][x].a;
+    if (chain.boxes) {
+        parallelBoxConvolution(out, in, chain.stages, chain.border);
+        return;
+    }
+
+    // Every band recomputes the intermediate rows of its own halo
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t y = 0; y < in.height; y += bandHeight) {
+        chainConvolution(out, in, chain, y, std::min(in.height, y + bandHeight));
+    }
+}
+
+
+void convolution(PlanarImage *__restrict__ out, const PlanarImage &__restrict__ in, const Filter &__restrict__ filter,
+                 BorderMode border)
+{
+    out->resize(in.width, in.height, in.colors.size(), !in.opaque());
+
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t y = 0; y < in.height; y += bandHeight) {
+        planarConvolution(out, in, filter, border, y, std::min(in.height, y + bandHeight));
+    }
+}
+
+
+void convolveIterate(Image &image, const Filter &filter, unsigned n, BorderMode border)
+{
+    size_t bandRows, bandColumns;
+    const size_t block = iterationBlock(filter, image.width, &bandRows, &bandColumns);
+
+    // Buffers of each thread, kept for all the iterations
+    const size_t threads = omp_get_max_threads();
+    std::vector<Image> bands(2 * threads);
+    std::vector<Workspace> workspaces(threads);
+
+    pingPong(image, n, block, [&](Image *out, const Image &in, size_t k) {
+        if (k == 1) {
+            convolution(out, in, filter, border);
+            return;
+        }
+
+        const size_t across = (in.width + bandColumns - 1) / bandColumns;
+        const size_t down = (in.height + bandRows - 1) / bandRows;
+
+        #pragma omp parallel for schedule(dynamic)
+        for (size_t i = 0; i < across * down; ++i) {
+            const size_t self = omp_get_thread_num();
+            const size_t x = (i % across) * bandColumns, y = (i / across) * bandRows;
+            iterateBand(out, in, filter, border, k, x, std::min(in.width, x + bandColumns),
+                        y, std::min(in.height, y + bandRows), &bands[2 * self], workspaces[self]);
         }
+    });
+}
+
+
+void convolution(Image *__restrict__ out, const Image &__restrict__ in, const Filter &__restrict__ filter,
+                 const std::vector<Region> &regions, BorderMode border)
+{
+    regionOutput(out, in.width, in.height);
+
+    // Bands of each region
+    const std::vector<Region> tiles = regionTiles(regions, in.width, in.height, in.width, bandHeight);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < tiles.size(); ++i) {
+        const Region &r = tiles[i];
+        tileConvolution(out, in, filter, border, r.x, r.x + r.width, r.y, r.y + r.height);
     }
 }
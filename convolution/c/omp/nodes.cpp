@@ -0,0 +1,201 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <numa.h>
+#include <omp.h>
+#include <string>
+#include "nodes.h"
+#include "../kernels/kernels.h"
+
+
+// Rows each thread takes at once from the part of its node
+static const size_t bandHeight = 64;
+
+
+bool numaMode()
+{
+    static const bool enabled = getenv("CONVOLUTION_NUMA") && std::string(getenv("CONVOLUTION_NUMA")) != "0" &&
+                                numa_available() >= 0;
+    return enabled;
+}
+
+
+// CONVOLUTION_NUMA=report: the bandwidth of each node, after every call
+static bool numaReport()
+{
+    static const bool enabled = getenv("CONVOLUTION_NUMA") && std::string(getenv("CONVOLUTION_NUMA")) == "report";
+    return enabled;
+}
+
+
+namespace {
+
+// Memory bound to a node
+class NodeBuffer
+{
+public:
+    NodeBuffer(size_t bytes, int node): bytes(bytes), address(numa_alloc_onnode(bytes, node))
+    {
+        if (!address)
+            throw std::bad_alloc();
+    }
+
+    ~NodeBuffer()
+    {
+        numa_free(address, bytes);
+    }
+
+    void* get() const
+    {
+        return address;
+    }
+
+private:
+    size_t bytes;
+    void *address;
+
+    NodeBuffer(const NodeBuffer&);
+    NodeBuffer& operator = (const NodeBuffer&);
+};
+
+
+// Output rows [r0, r1), computed by the threads [first, first + threads)
+// Row j of strip is the input row at r0 + j - filter.height / 2, with the
+// vertical border already applied
+struct NodePart
+{
+    int node;
+    size_t r0, r1, first, threads;
+    std::unique_ptr<NodeBuffer> buffer;
+    Image strip;
+    std::atomic<size_t> next;
+    // When each of its threads was done with it, from omp_get_wtime
+    std::vector<double> finished;
+};
+
+}
+
+
+// Nodes that have CPUs
+static std::vector<int> cpuNodes()
+{
+    std::vector<int> nodes;
+    struct bitmask *cpus = numa_allocate_cpumask();
+    for (int node = 0; node <= numa_max_node(); ++node)
+        if (numa_node_to_cpus(node, cpus) == 0 && numa_bitmask_weight(cpus) > 0)
+            nodes.push_back(node);
+    numa_free_cpumask(cpus);
+    return nodes;
+}
+
+
+void numaConvolution(Image *out, const Image &in, const Filter &filter, BorderMode border)
+{
+    // Pages of a new output are first touched by the node that computes them
+    out->resizeUninitialized(in.width, in.height);
+    if (filter.height == 0 || in.height == 0) {
+        bandConvolution(out, in, filter, border, 0, in.height);
+        return;
+    }
+
+    static const std::vector<int> nodes = cpuNodes();
+    const size_t nThreads = omp_get_max_threads();
+    const size_t nParts = std::max<size_t>(1, std::min(nodes.size(), std::min(nThreads, in.height)));
+    const size_t half = filter.height / 2, halo = filter.height - 1;
+    const size_t rowBytes = in.width * sizeof(Pixel);
+    const std::vector<ptrdiff_t> rows = borderTable(in.height, filter.height, border);
+
+    std::vector<std::unique_ptr<NodePart> > parts;
+    for (size_t k = 0; k < nParts; ++k) {
+        NodePart *part = new NodePart;
+        parts.push_back(std::unique_ptr<NodePart>(part));
+        part->node = nodes.empty() ? 0 : nodes[k];
+        part->r0 = k * in.height / nParts;
+        part->r1 = (k + 1) * in.height / nParts;
+        part->next = 0;
+
+        const size_t stride = Image::alignedStride(in.width);
+        const size_t height = part->r1 - part->r0 + halo;
+        part->buffer.reset(new NodeBuffer(stride * height * sizeof(Pixel), part->node));
+        part->strip = Image(static_cast<Pixel*>(part->buffer->get()), in.width, height, stride);
+    }
+
+    const double start = omp_get_wtime();
+    #pragma omp parallel num_threads(nThreads)
+    {
+        // The team may be smaller than asked for (nested, dynamic or a thread
+        // limit), so the threads are split among the parts only now. With
+        // fewer threads than parts, a thread takes several of them
+        const size_t t = omp_get_thread_num(), team = omp_get_num_threads();
+        std::vector<size_t> mine;
+        #pragma omp single
+        for (size_t k = 0; k < nParts; ++k) {
+            parts[k]->first = k * team / nParts;
+            parts[k]->threads = std::max<size_t>(1, (k + 1) * team / nParts - parts[k]->first);
+            parts[k]->finished.assign(parts[k]->threads, start);
+        }
+        for (size_t k = 0; k < nParts; ++k)
+            if (t >= parts[k]->first && t < parts[k]->first + parts[k]->threads)
+                mine.push_back(k);
+
+        // The thread is moved to the node of each of its parts, and put back
+        // where it was before it leaves
+        struct bitmask *affinity = numa_allocate_cpumask();
+        const bool saved = numa_sched_getaffinity(0, affinity) >= 0;
+
+        // Replicate the input rows of the parts, halo included
+        for (size_t i = 0; i < mine.size(); ++i) {
+            NodePart &part = *parts[mine[i]];
+            numa_run_on_node(part.node);
+            for (size_t j = t - part.first; j < part.strip.height; j += part.threads) {
+                const ptrdiff_t imageY = rows[part.r0 + j];
+                if (imageY < 0)
+                    std::fill(part.strip.row(j), part.strip.row(j) + in.width, Pixel());
+                else
+                    memcpy(part.strip.row(j), in.row(imageY), rowBytes);
+            }
+        }
+        #pragma omp barrier
+
+        // Each band is computed from a view on the strip, which has all the
+        // rows it reads, into a buffer of this thread, then copied out
+        Image band;
+        for (size_t i = 0; i < mine.size(); ++i) {
+            NodePart &part = *parts[mine[i]];
+            numa_run_on_node(part.node);
+            const size_t n = part.r1 - part.r0;
+            for (size_t b0 = part.next.fetch_add(bandHeight); b0 < n; b0 = part.next.fetch_add(bandHeight)) {
+                const size_t b1 = std::min(n, b0 + bandHeight);
+                const Image view(part.strip.row(b0), in.width, b1 - b0 + halo, part.strip.stride);
+                band.resize(view.width, view.height);
+                bandConvolution(&band, view, filter, border, half, half + b1 - b0);
+
+                for (size_t r = 0; r < b1 - b0; ++r)
+                    memcpy(out->row(part.r0 + b0 + r), band.row(half + r), rowBytes);
+            }
+            part.finished[t - part.first] = omp_get_wtime();
+        }
+
+        if (saved)
+            numa_sched_setaffinity(0, affinity);
+        numa_free_cpumask(affinity);
+    }
+
+    if (!numaReport())
+        return;
+
+    // Bytes each node moved: the input rows read and copied to its strip,
+    // and its output rows written
+    for (size_t k = 0; k < nParts; ++k) {
+        const NodePart &part = *parts[k];
+        const double seconds = *std::max_element(part.finished.begin(), part.finished.end()) - start;
+        const double bytes = (2.0 * part.strip.height + (part.r1 - part.r0)) * rowBytes;
+        std::cerr << "Node " << part.node << ": " << part.threads << " threads, rows " << part.r0 << "-"
+                  << part.r1 << ", " << std::fixed << std::setprecision(2) << seconds * 1e3 << " ms, "
+                  << bytes / seconds / 1e9 << " GB/s" << std::endl;
+    }
+}
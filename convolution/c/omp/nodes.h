@@ -0,0 +1,23 @@
+#ifndef _NODES_H_
+#define _NODES_H_
+
+#include "../convolution.h"
+
+// Only built when libnuma is found (HAVE_NUMA), CONVOLUTION_NUMA is ignored
+// otherwise
+
+// True if CONVOLUTION_NUMA is set (to anything but 0) and the system
+// supports NUMA
+bool numaMode();
+
+// NUMA aware version of the Filter overload
+// The rows are split into one contiguous part per node. The threads of each
+// node, pinned to its CPUs, copy the input rows their part reads (halo
+// included) into memory on the node, and are the first to write its output
+// rows, so those pages end up there too. The threads are back on the CPUs
+// they had when this returns
+// With CONVOLUTION_NUMA=report, each call then writes one line per node to
+// the standard error: its threads, rows, time and the bandwidth it reached
+void numaConvolution(Image *out, const Image &in, const Filter &filter, BorderMode border);
+
+#endif // _NODES_H_
@@ -0,0 +1,212 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include "processes.h"
+#include "segment.h"
+#include "../kernels/kernels.h"
+
+extern char **environ;
+
+typedef std::chrono::steady_clock Clock;
+
+// Input and output of a band, at most. Larger images get more bands than
+// workers, so the segments mapped at once stay bounded
+static const size_t maxBandBytes = 64 << 20;
+
+
+size_t processCount()
+{
+    static const size_t count = getenv("CONVOLUTION_PROCESSES")
+        ? std::max(0l, atol(getenv("CONVOLUTION_PROCESSES"))) : 0;
+    return count;
+}
+
+
+// Seconds a worker has for its band: CONVOLUTION_PROCESS_TIMEOUT if set,
+// a minute otherwise
+static std::chrono::seconds processTimeout()
+{
+    static const long seconds = getenv("CONVOLUTION_PROCESS_TIMEOUT")
+        ? std::max(1l, atol(getenv("CONVOLUTION_PROCESS_TIMEOUT"))) : 60;
+    return std::chrono::seconds(seconds);
+}
+
+
+// CONVOLUTION_WORKER if set, convolution_omp_worker next to the executable
+// otherwise
+static std::string workerPath()
+{
+    if (getenv("CONVOLUTION_WORKER"))
+        return getenv("CONVOLUTION_WORKER");
+
+    char path[PATH_MAX];
+    const ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (length < 0)
+        return "convolution_omp_worker";
+    std::string executable(path, length);
+    return executable.substr(0, executable.rfind('/') + 1) + "convolution_omp_worker";
+}
+
+
+namespace {
+
+// Output rows [r0, r1), computed by the worker pid on the segment
+struct ProcessBand
+{
+    size_t r0, r1;
+    std::unique_ptr<SharedSegment> segment;
+    pid_t pid;
+    Clock::time_point deadline;
+};
+
+}
+
+
+// Kills the worker, and reaps it so it does not linger
+static void stopWorker(pid_t pid)
+{
+    if (pid <= 0)
+        return;
+    kill(pid, SIGKILL);
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+        ;
+}
+
+
+// False if the worker crashed or failed, or if it is still running at the
+// deadline: then it is killed
+static bool waitWorker(pid_t pid, Clock::time_point deadline)
+{
+    if (pid <= 0)
+        return false;
+
+    // Polled, with pauses that grow up to a few milliseconds
+    std::chrono::microseconds pause(50);
+    int status = 0;
+    for (;;) {
+        const pid_t done = waitpid(pid, &status, WNOHANG);
+        if (done == pid)
+            return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        if (done < 0 && errno != EINTR)
+            return false;
+        if (Clock::now() >= deadline) {
+            stopWorker(pid);
+            return false;
+        }
+        std::this_thread::sleep_for(pause);
+        pause = std::min(pause * 2, std::chrono::microseconds(5000));
+    }
+}
+
+
+// Creates the segment of the band, copies its input rows there, and starts
+// the worker on it
+// The worker is a new executable, not a fork: a fork of a process with
+// threads could only do async-signal-safe work, and the kernels allocate
+static void startBand(ProcessBand &band, const Image &in, const Filter &filter, BorderMode border,
+                      const std::vector<ptrdiff_t> &rows, size_t halo, const std::string &worker)
+{
+    // Unique across the calls, including those running at the same time
+    static std::atomic<unsigned long> counter(0);
+    std::ostringstream name;
+    name << "/convolution-" << getpid() << "-" << counter++;
+
+    const size_t n = band.r1 - band.r0;
+    band.segment.reset(new SharedSegment(name.str(), in.width, n, n + halo, filter, border));
+
+    Image strip = band.segment->strip();
+    const size_t rowBytes = in.width * sizeof(Pixel);
+    for (size_t j = 0; j < strip.height; ++j) {
+        const ptrdiff_t imageY = rows[band.r0 + j];
+        if (imageY < 0)
+            std::fill(strip.row(j), strip.row(j) + in.width, Pixel());
+        else
+            memcpy(strip.row(j), in.row(imageY), rowBytes);
+    }
+
+    const std::string segmentName = name.str();
+    char *argv[] = {const_cast<char*>(worker.c_str()), const_cast<char*>(segmentName.c_str()), NULL};
+    const int error = posix_spawn(&band.pid, worker.c_str(), NULL, NULL, argv, environ);
+    if (error != 0) {
+        band.pid = -1;
+        throw std::runtime_error("Could not start " + worker + ": " + strerror(error));
+    }
+    band.deadline = Clock::now() + processTimeout();
+}
+
+
+void processConvolution(Image *out, const Image &in, const Filter &filter, BorderMode border, size_t workers)
+{
+    out->resize(in.width, in.height);
+    if (filter.height == 0 || in.height == 0) {
+        bandConvolution(out, in, filter, border, 0, in.height);
+        return;
+    }
+
+    workers = std::max<size_t>(1, workers);
+    const size_t halo = filter.height - 1;
+    const size_t rowBytes = in.width * sizeof(Pixel);
+    const size_t rowsPerBand = std::max<size_t>(1, maxBandBytes / (2 * Image::alignedStride(in.width)
+                                                                    * sizeof(Pixel)));
+    const size_t nBands = std::min(in.height, std::max(workers, (in.height + rowsPerBand - 1) / rowsPerBand));
+    const std::vector<ptrdiff_t> rows = borderTable(in.height, filter.height, border);
+    const std::string worker = workerPath();
+
+    // At most one band per worker in flight. The oldest one is waited for,
+    // copied back and removed before the next one starts
+    std::deque<ProcessBand> running;
+    std::vector<std::string> failed;
+    size_t next = 0;
+    try {
+        while (next < nBands || !running.empty()) {
+            while (next < nBands && running.size() < workers) {
+                running.push_back(ProcessBand());
+                ProcessBand &band = running.back();
+                band.r0 = next * in.height / nBands;
+                band.r1 = (next + 1) * in.height / nBands;
+                band.pid = -1;
+                ++next;
+                startBand(band, in, filter, border, rows, halo, worker);
+            }
+
+            ProcessBand &band = running.front();
+            if (waitWorker(band.pid, band.deadline)) {
+                const Image output = band.segment->output();
+                for (size_t y = 0; y < output.height; ++y)
+                    memcpy(out->row(band.r0 + y), output.row(y), rowBytes);
+            }
+            else {
+                std::ostringstream range;
+                range << band.r0 << "-" << band.r1;
+                failed.push_back(range.str());
+            }
+            running.pop_front();
+        }
+    }
+    catch (...) {
+        // The workers already started are not left to linger
+        for (size_t i = 0; i < running.size(); ++i)
+            stopWorker(running[i].pid);
+        throw;
+    }
+
+    if (!failed.empty()) {
+        std::string list = failed[0];
+        for (size_t i = 1; i < failed.size(); ++i)
+            list += ", " + failed[i];
+        throw std::runtime_error("The worker processes of the rows " + list + " failed");
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef _PROCESSES_H_
+#define _PROCESSES_H_
+
+#include "../convolution.h"
+
+// Worker processes the Filter overload runs on: CONVOLUTION_PROCESSES if set,
+// 0 (none, threads only) otherwise
+size_t processCount();
+
+// Multi-process version of the Filter overload
+// The rows are split into bands, at least one per worker and more for large
+// images. Each band, with its halo rows and the vertical border already
+// applied, is copied into a POSIX shared memory segment of its own, next to
+// the filter and room for its output. A worker process opens the segment by
+// name, maps it and convolves the band there, on a single thread; the parent
+// copies the output rows back from the mapping and removes the segment. At
+// most one band per worker is in flight
+// The worker is convolution_omp_worker, next to the executable, or
+// CONVOLUTION_WORKER if set
+// No pixel goes through a pipe, and a worker only touches its own segment
+// A worker that crashes, or that takes longer than CONVOLUTION_PROCESS_TIMEOUT
+// seconds (a minute by default) and is then killed, makes this throw; the
+// calling process goes on
+void processConvolution(Image *out, const Image &in, const Filter &filter, BorderMode border, size_t workers);
+
+#endif // _PROCESSES_H_
@@ -0,0 +1,111 @@
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "segment.h"
+
+
+static std::runtime_error systemError(const std::string &what, const std::string &name)
+{
+    return std::runtime_error(what + " " + name + ": " + strerror(errno));
+}
+
+
+// Coefficients of a w x h filter, padded so the pixels after them are aligned
+static size_t coefficientBytes(size_t w, size_t h)
+{
+    return (w * h * sizeof(double) + MATRIX_ALIGNMENT - 1) / MATRIX_ALIGNMENT * MATRIX_ALIGNMENT;
+}
+
+
+SharedSegment::SharedSegment(const std::string &name, size_t width, size_t rows, size_t stripRows,
+                             const Filter &filter, BorderMode border):
+    name(name), bytes(0), address(MAP_FAILED), creator(true)
+{
+    const size_t stride = Image::alignedStride(width);
+    bytes = sizeof(BandHeader) + coefficientBytes(filter.width, filter.height)
+        + (rows + stripRows) * stride * sizeof(Pixel);
+
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        throw systemError("Could not create", name);
+    if (ftruncate(fd, bytes) == 0)
+        address = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        throw systemError("Could not map", name);
+    }
+
+    BandHeader *h = header();
+    h->width = width;
+    h->stride = stride;
+    h->rows = rows;
+    h->stripRows = stripRows;
+    h->filterWidth = filter.width;
+    h->filterHeight = filter.height;
+    h->border = border;
+    h->quantized = !filter.fixed.coefficients.empty();
+
+    // Row by row, the rows of the filter are padded
+    for (size_t y = 0; y < filter.height; ++y)
+        memcpy(coefficients() + y * filter.width, filter[y], filter.width * sizeof(double));
+}
+
+
+SharedSegment::SharedSegment(const std::string &name): name(name), bytes(0), address(MAP_FAILED), creator(false)
+{
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0)
+        throw systemError("Could not open", name);
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        bytes = st.st_size;
+        address = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (address == MAP_FAILED)
+        throw systemError("Could not map", name);
+
+    // A header that does not match the size would send the worker out of it
+    const BandHeader *h = header();
+    if (bytes < sizeof(BandHeader) || h->stride < h->width
+        || bytes < sizeof(BandHeader) + coefficientBytes(h->filterWidth, h->filterHeight)
+                   + (h->rows + h->stripRows) * h->stride * sizeof(Pixel)) {
+        munmap(address, bytes);
+        throw std::runtime_error("The segment " + name + " is not a band");
+    }
+}
+
+
+SharedSegment::~SharedSegment()
+{
+    munmap(address, bytes);
+    if (creator)
+        shm_unlink(name.c_str());
+}
+
+
+Pixel* SharedSegment::pixels() const
+{
+    const BandHeader *h = header();
+    return reinterpret_cast<Pixel*>(reinterpret_cast<uint8_t*>(address) + sizeof(BandHeader)
+                                    + coefficientBytes(h->filterWidth, h->filterHeight));
+}
+
+
+Image SharedSegment::strip() const
+{
+    const BandHeader *h = header();
+    return Image(pixels(), h->width, h->stripRows, h->stride);
+}
+
+
+Image SharedSegment::output() const
+{
+    const BandHeader *h = header();
+    return Image(pixels() + h->stripRows * h->stride, h->width, h->rows, h->stride);
+}
@@ -0,0 +1,68 @@
+#ifndef _SEGMENT_H_
+#define _SEGMENT_H_
+
+#include <cstdint>
+#include <string>
+#include "../convolution.h"
+
+// Start of each segment, the filter coefficients follow it, then the input
+// strip and then the output
+// Everything a worker needs to find its way in the segment, and to rebuild
+// the filter
+struct BandHeader
+{
+    uint64_t width, stride;         // Stride in pixels
+    uint64_t rows;                  // Output rows of the band
+    uint64_t stripRows;             // Input rows, rows plus the halo
+    uint64_t filterWidth, filterHeight;
+    uint32_t border;
+    uint32_t quantized;             // The worker quantizes the filter too
+    uint8_t  reserved[MATRIX_ALIGNMENT - 56];
+};
+
+static_assert(sizeof(BandHeader) == MATRIX_ALIGNMENT, "The pixels must stay aligned");
+
+
+// Shared memory segment of a band, mapped read and write
+// The one that creates it also removes it
+class SharedSegment
+{
+public:
+    // Creates a new segment for the band, with its header filled in
+    SharedSegment(const std::string &name, size_t width, size_t rows, size_t stripRows, const Filter &filter,
+                  BorderMode border);
+    // Opens an existing one
+    explicit SharedSegment(const std::string &name);
+    ~SharedSegment();
+
+    BandHeader* header() const
+    {
+        return static_cast<BandHeader*>(address);
+    }
+
+    // Row major, without padding
+    double* coefficients() const
+    {
+        return reinterpret_cast<double*>(header() + 1);
+    }
+
+    // Input rows, halo included, with the vertical border already applied
+    Image strip() const;
+    // Output rows, right after the strip. The first one goes with the row
+    // filter.height / 2 of the strip
+    Image output() const;
+
+private:
+    std::string name;
+    size_t bytes;
+    void *address;
+    bool creator;
+
+    // The pixels start at the first aligned address after the coefficients
+    Pixel* pixels() const;
+
+    SharedSegment(const SharedSegment&);
+    SharedSegment& operator = (const SharedSegment&);
+};
+
+#endif // _SEGMENT_H_
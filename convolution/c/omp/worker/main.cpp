@@ -0,0 +1,42 @@
+#include <iostream>
+#include "../segment.h"
+#include "../../kernels/kernels.h"
+
+
+// Worker process of the multi-process mode of convolution_omp: convolves the
+// band of the segment named on the command line, on a single thread
+// Started by processConvolution, not meant to be run by hand
+int main(int argc, const char *argv[])
+{
+    if (argc != 2) {
+        std::cerr << "Usage: " << argv[0] << " <segment>" << std::endl;
+        return 1;
+    }
+
+    try {
+        SharedSegment segment(argv[1]);
+        const BandHeader *header = segment.header();
+
+        Filter filter(header->filterWidth, header->filterHeight);
+        for (size_t y = 0; y < filter.height; ++y)
+            for (size_t x = 0; x < filter.width; ++x)
+                filter[y][x] = segment.coefficients()[y * filter.width + x];
+        filter.plan();
+        if (header->quantized)
+            filter.quantize();
+
+        // Indexed as the strip, so its rows [half, half + rows) are the output
+        // ones; those before them fall on the strip, and are not written
+        const Image strip = segment.strip(), output = segment.output();
+        const size_t half = filter.height / 2;
+        Image target(output.values - half * output.stride, output.width, strip.height, output.stride);
+        bandConvolution(&target, strip, filter, static_cast<BorderMode>(header->border),
+                        half, half + output.height);
+    }
+    catch (const std::exception &e) {
+        std::cerr << argv[1] << ": " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
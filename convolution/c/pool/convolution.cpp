@@ -0,0 +1,151 @@
+#include <algorithm>
+#include "pool.h"
+#include "../kernels/kernels.h"
+
+
+// Tiles of the output, each one a task
+// Every tile recomputes the halo of its rings, so they are kept large
+// enough for that to be small, and small enough to leave tiles to steal
+static const size_t tileRows = 64;
+static const size_t tileColumns = 512;
+// Columns of the strips the vertical passes of the boxes are split into
+static const size_t stripColumns = 64;
+
+
+// boxRows over bands, then boxColumns over strips
+static void poolBoxConvolution(TaskPool &pool, Image *out, const Image &in, const std::vector<Filter> &boxes,
+                               BorderMode border)
+{
+    Matrix<float> sums(3 * in.width, in.height);
+
+    pool.run((in.height + tileRows - 1) / tileRows, [&](size_t i) {
+        boxRows(&sums, in, boxes, border, i * tileRows, std::min(in.height, (i + 1) * tileRows));
+    });
+    pool.run((in.width + stripColumns - 1) / stripColumns, [&](size_t i) {
+        boxColumns(out, in, sums, boxes, border, i * stripColumns, std::min(in.width, (i + 1) * stripColumns));
+    });
+}
+
+
+void poolConvolution(TaskPool &pool, Image *out, const Image &in, const Filter &filter, BorderMode border)
+{
+    out->resize(in.width, in.height);
+
+    if (filter.box) {
+        poolBoxConvolution(pool, out, in, std::vector<Filter>(1, filter), border);
+        return;
+    }
+
+    // Row major, so the run each thread starts with is a few bands
+    const size_t across = (in.width + tileColumns - 1) / tileColumns;
+    const size_t down = (in.height + tileRows - 1) / tileRows;
+
+    pool.run(across * down, [&](size_t i) {
+        const size_t x0 = (i % across) * tileColumns, y0 = (i / across) * tileRows;
+        tileConvolution(out, in, filter, border, x0, std::min(in.width, x0 + tileColumns),
+                        y0, std::min(in.height, y0 + tileRows));
+    });
+}
+
+
+// Work stealing implementation
+void convolution(Image *out, const Image &in, const Filter &filter, BorderMode border)
+{
+    poolConvolution(sharedPool(), out, in, filter, border);
+}
+
+
+// Wider pixels have no running sums, boxes go through tileConvolution
+template <class P>
+static void wideConvolution(Matrix<P> *out, const Matrix<P> &in, const Filter &filter, BorderMode border)
+{
+    out->resize(in.width, in.height);
+
+    const size_t across = (in.width + tileColumns - 1) / tileColumns;
+    const size_t down = (in.height + tileRows - 1) / tileRows;
+
+    sharedPool().run(across * down, [&](size_t i) {
+        const size_t x0 = (i % across) * tileColumns, y0 = (i / across) * tileRows;
+        tileConvolution(out, in, filter, border, x0, std::min(in.width, x0 + tileColumns),
+                        y0, std::min(in.height, y0 + tileRows));
+    });
+}
+
+
+void convolution(Image16 *out, const Image16 &in, const Filter &filter, BorderMode border)
+{
+    wideConvolution(out, in, filter, border);
+}
+
+
+void convolution(ImageF *out, const ImageF &in, const Filter &filter, BorderMode border)
+{
+    wideConvolution(out, in, filter, border);
+}
+
+
+// Chains and planes are split in bands only
+void convolution(Image *out, const Image &in, const FilterChain &chain)
+{
+    out->resize(in.width, in.height);
+
+    if (chain.boxes) {
+        poolBoxConvolution(sharedPool(), out, in, chain.stages, chain.border);
+        return;
+    }
+
+    sharedPool().run((in.height + tileRows - 1) / tileRows, [&](size_t i) {
+        chainConvolution(out, in, chain, i * tileRows, std::min(in.height, (i + 1) * tileRows));
+    });
+}
+
+
+void convolution(PlanarImage *out, const PlanarImage &in, const Filter &filter, BorderMode border)
+{
+    out->resize(in.width, in.height, in.colors.size(), !in.opaque());
+
+    sharedPool().run((in.height + tileRows - 1) / tileRows, [&](size_t i) {
+        planarConvolution(out, in, filter, border, i * tileRows, std::min(in.height, (i + 1) * tileRows));
+    });
+}
+
+
+void convolveIterate(Image &image, const Filter &filter, unsigned n, BorderMode border)
+{
+    size_t bandRows, bandColumns;
+    const size_t block = iterationBlock(filter, image.width, &bandRows, &bandColumns);
+
+    // Buffers of each thread, kept for all the iterations
+    TaskPool &pool = sharedPool();
+    std::vector<Image> bands(2 * pool.size());
+    std::vector<Workspace> workspaces(pool.size());
+
+    pingPong(image, n, block, [&](Image *out, const Image &in, size_t k) {
+        if (k == 1) {
+            convolution(out, in, filter, border);
+            return;
+        }
+
+        const size_t across = (in.width + bandColumns - 1) / bandColumns;
+        const size_t down = (in.height + bandRows - 1) / bandRows;
+
+        pool.runIndexed(across * down, [&](size_t i, size_t self) {
+            const size_t x = (i % across) * bandColumns, y = (i / across) * bandRows;
+            iterateBand(out, in, filter, border, k, x, std::min(in.width, x + bandColumns),
+                        y, std::min(in.height, y + bandRows), &bands[2 * self], workspaces[self]);
+        });
+    });
+}
+
+
+void convolution(Image *out, const Image &in, const Filter &filter, const std::vector<Region> &regions,
+                 BorderMode border)
+{
+    regionOutput(out, in.width, in.height);
+
+    const std::vector<Region> tiles = regionTiles(regions, in.width, in.height, tileColumns, tileRows);
+    sharedPool().run(tiles.size(), [&](size_t i) {
+        const Region &r = tiles[i];
+        tileConvolution(out, in, filter, border, r.x, r.x + r.width, r.y, r.y + r.height);
+    });
+}
@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <cstdlib>
+#include "pool.h"
+
+
+TaskPool::TaskPool(size_t n): task(NULL), generation(0), busy(0), failed(false), stopping(false)
+{
+    if (n == 0)
+        n = std::max(1u, std::thread::hardware_concurrency());
+
+    for (size_t i = 0; i < n; ++i)
+        queues.push_back(std::unique_ptr<Queue>(new Queue));
+
+    // The caller of run is the thread 0
+    for (size_t i = 1; i < n; ++i)
+        threads.push_back(std::thread(&TaskPool::worker, this, i));
+}
+
+
+TaskPool::~TaskPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        stopping = true;
+        started.notify_all();
+    }
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+}
+
+
+void TaskPool::run(size_t n, const std::function<void(size_t)> &fn)
+{
+    runIndexed(n, [&fn](size_t i, size_t) { fn(i); });
+}
+
+
+void TaskPool::runIndexed(size_t n, const std::function<void(size_t, size_t)> &fn)
+{
+    std::lock_guard<std::mutex> batch(batchMutex);
+    if (n == 0)
+        return;
+
+    const size_t nThreads = queues.size();
+    for (size_t t = 0; t < nThreads; ++t) {
+        std::lock_guard<std::mutex> lock(queues[t]->mutex);
+        for (size_t i = t * n / nThreads; i < (t + 1) * n / nThreads; ++i)
+            queues[t]->tasks.push_back(i);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        task = &fn;
+        failed = false;
+        error = std::exception_ptr();
+        busy = nThreads - 1;
+        ++generation;
+        started.notify_all();
+    }
+
+    work(0);
+
+    // Every thread takes part in every batch, so none can miss one
+    std::exception_ptr thrown;
+    {
+        std::unique_lock<std::mutex> lock(stateMutex);
+        finished.wait(lock, [this] { return busy == 0; });
+        task = NULL;
+        std::swap(thrown, error);
+    }
+    if (thrown)
+        std::rethrow_exception(thrown);
+}
+
+
+void TaskPool::worker(size_t self)
+{
+    size_t seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(stateMutex);
+            started.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping)
+                return;
+            seen = generation;
+        }
+
+        work(self);
+
+        std::lock_guard<std::mutex> lock(stateMutex);
+        if (--busy == 0)
+            finished.notify_one();
+    }
+}
+
+
+// Own tasks from the front, the others' from the back
+// No task is added during a batch, so once all the deques are seen empty
+// there is nothing left for this thread
+bool TaskPool::next(size_t self, size_t *i)
+{
+    const size_t nThreads = queues.size();
+    for (size_t k = 0; k < nThreads; ++k) {
+        Queue &queue = *queues[(self + k) % nThreads];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty())
+            continue;
+
+        if (k == 0) {
+            *i = queue.tasks.front();
+            queue.tasks.pop_front();
+        }
+        else {
+            *i = queue.tasks.back();
+            queue.tasks.pop_back();
+        }
+        return true;
+    }
+    return false;
+}
+
+
+void TaskPool::work(size_t self)
+{
+    size_t i;
+    while (next(self, &i)) {
+        if (failed)
+            continue;
+        try {
+            (*task)(i, self);
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            if (!error)
+                error = std::current_exception();
+            failed = true;
+        }
+    }
+}
+
+
+TaskPool& sharedPool()
+{
+    static TaskPool pool(getenv("CONVOLUTION_THREADS") ? std::max(0l, atol(getenv("CONVOLUTION_THREADS"))) : 0);
+    return pool;
+}
@@ -0,0 +1,77 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "../convolution.h"
+
+// Fixed set of threads running batches of independent tasks
+// Every thread has its own deque: it takes tasks from the front of its own
+// and, once that is empty, steals from the back of the others'. A thread
+// slowed down by other load just ends up doing fewer tasks
+// Tasks are meant to be coarse (tiles), so each deque is a plain locked one
+class TaskPool
+{
+public:
+    // threads counts the caller of run, which works too; 0 for one per core
+    explicit TaskPool(size_t threads = 0);
+    ~TaskPool();
+
+    size_t size() const
+    {
+        return queues.size();
+    }
+
+    // Runs task(i) for every i in [0, n), and returns once all are done
+    // Each thread starts on a contiguous run of them, so neighbouring tiles
+    // share their halos in cache. The first exception thrown by a task is
+    // rethrown here, the tasks not started by then are skipped
+    // Batches from several callers run one after the other; a task must not
+    // call run on its own pool
+    void run(size_t n, const std::function<void(size_t)> &task);
+    // Same, with task(i, thread) also given the thread that runs it, in
+    // [0, size()), so it can use buffers of that thread
+    void runIndexed(size_t n, const std::function<void(size_t, size_t)> &task);
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue> > queues;
+    std::vector<std::thread> threads;
+
+    // Current batch
+    std::mutex batchMutex, stateMutex;
+    std::condition_variable started, finished;
+    const std::function<void(size_t, size_t)> *task;
+    size_t generation, busy;
+    std::atomic<bool> failed;
+    std::exception_ptr error;
+    bool stopping;
+
+    void worker(size_t self);
+    bool next(size_t self, size_t *i);
+    void work(size_t self);
+
+    TaskPool(const TaskPool&);
+    TaskPool& operator = (const TaskPool&);
+};
+
+// Threads of the pool the convolution() overloads of this backend share:
+// CONVOLUTION_THREADS if set, one per core otherwise
+TaskPool& sharedPool();
+
+// The convolution of this backend on a given pool, split in tiles
+void poolConvolution(TaskPool &pool, Image *out, const Image &in, const Filter &filter, BorderMode border);
+
+#endif // _POOL_H_
@@ -0,0 +1,79 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include "../pool.h"
+
+
+int usage(const char* bin)
+{
+    std::cerr << "Usage: " << bin << " [width] [height] [filter size] [max threads] [repetitions]" << std::endl
+              << "Times the convolution of a random image with a random dense filter on 1 to max threads"
+              << " (one per core by default)" << std::endl;
+    return 1;
+}
+
+
+int main(int argc, const char *argv[])
+{
+    if (argc < 4)
+        return usage(argv[0]);
+
+    const size_t width = atol(argv[1]), height = atol(argv[2]), size = atol(argv[3]);
+    const size_t maxThreads = (argc > 4) ? atol(argv[4]) : std::max(1u, std::thread::hardware_concurrency());
+    const size_t repetitions = (argc > 5) ? std::max(1l, atol(argv[5])) : 10;
+    if (width == 0 || height == 0 || size == 0 || maxThreads == 0)
+        return usage(argv[0]);
+
+    Image image(width, height);
+    for (size_t y = 0; y < height; ++y) {
+        for (size_t x = 0; x < width; ++x) {
+            image[y][x].r = rand();
+            image[y][x].g = rand();
+            image[y][x].b = rand();
+            image[y][x].a = rand();
+        }
+    }
+
+    // Random coefficients, so it is neither separable nor sparse
+    Filter filter(size);
+    for (size_t y = 0; y < size; ++y)
+        for (size_t x = 0; x < size; ++x)
+            filter[y][x] = (rand() % 1000) / (1000.0 * size * size);
+    filter.plan();
+
+    std::cout << "Image:  " << width << "x" << height << std::endl
+              << "Filter: " << size << "x" << size << std::endl
+              << std::setw(8) << "threads" << std::setw(12) << "median ms" << std::setw(12) << "best ms"
+              << std::setw(10) << "speedup" << std::setw(12) << "efficiency" << std::endl;
+
+    double serial = 0;
+    Image output;
+    for (size_t n = 1; n <= maxThreads; ++n) {
+        TaskPool pool(n);
+
+        // The first run pays for the allocation of the output
+        poolConvolution(pool, &output, image, filter, BorderWrap);
+
+        std::vector<double> times;
+        for (size_t r = 0; r < repetitions; ++r) {
+            auto start = std::chrono::steady_clock::now();
+            poolConvolution(pool, &output, image, filter, BorderWrap);
+            auto end = std::chrono::steady_clock::now();
+            times.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+        }
+        std::sort(times.begin(), times.end());
+
+        const double median = times[times.size() / 2];
+        if (n == 1)
+            serial = median;
+
+        std::cout << std::setw(8) << n << std::fixed << std::setprecision(2)
+                  << std::setw(12) << median << std::setw(12) << times[0]
+                  << std::setw(10) << serial / median << std::setw(12) << serial / median / n << std::endl;
+    }
+
+    return 0;
+}
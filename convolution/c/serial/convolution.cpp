@@ -1,40 +1,90 @@
+#include <algorithm>
 #include "../convolution.h"
+#include "../kernels/kernels.h"
 
 
-static uint8_t truncate(double v)
+// Serial implementation
+void convolution(Image *out, const Image &in, const Filter &filter, BorderMode border)
 {
-    int vi = static_cast<int>(v);
-    if (vi < 0)   vi = 0;
-    if (vi > 255) vi = 255;
+    out->resize(in.width, in.height);
 
-    return static_cast<uint8_t>(vi);
+    if (filter.box)
+        boxConvolution(out, in, std::vector<Filter>(1, filter), border);
+    else
+        bandConvolution(out, in, filter, border, 0, in.height);
 }
 
-// Serial implementation
-// Adapted from http://lodev.org/cgtutor/filtering.html
-void convolution(Image *out, const Image &in, const Filter &filter)
+
+// Wider pixels have no running sums, boxes go through tileConvolution
+template <class P>
+static void wideConvolution(Matrix<P> *out, const Matrix<P> &in, const Filter &filter, BorderMode border)
 {
     out->resize(in.width, in.height);
 
-    for (size_t y = 0; y < in.height; ++y) {
-        for (size_t x = 0; x < in.width; ++x) {
-            double red = 0, green = 0, blue = 0;
-
-            for (size_t filterY = 0; filterY < filter.height; ++filterY) {
-                for (size_t filterX = 0; filterX < filter.width; ++filterX) {
-                    size_t imageX = (x - filter.width / 2 + filterX + in.width) % in.width;
-                    size_t imageY = (y - filter.height / 2 + filterY + in.height) % in.height;
-
-                    red   += in.values[imageY][imageX].r * filter.values[filterY][filterX];
-                    green += in.values[imageY][imageX].g * filter.values[filterY][filterX];
-                    blue  += in.values[imageY][imageX].b * filter.values[filterY][filterX];
-                }
-            }
-            // truncate values smaller than 0 and larger than 255
-            out->values[y][x].r = truncate(red);
-            out->values[y][x].g = truncate(green);
-            out->values[y][x].b = truncate(blue);
-            out->values[y][x].a = in.values[y][x].a;
+    tileConvolution(out, in, filter, border, 0, in.width, 0, in.height);
+}
+
+
+void convolution(Image16 *out, const Image16 &in, const Filter &filter, BorderMode border)
+{
+    wideConvolution(out, in, filter, border);
+}
+
+
+void convolution(ImageF *out, const ImageF &in, const Filter &filter, BorderMode border)
+{
+    wideConvolution(out, in, filter, border);
+}
+
+
+void convolution(Image *out, const Image &in, const FilterChain &chain)
+{
+    out->resize(in.width, in.height);
+
+    if (chain.boxes)
+        boxConvolution(out, in, chain.stages, chain.border);
+    else
+        chainConvolution(out, in, chain, 0, in.height);
+}
+
+
+void convolution(PlanarImage *out, const PlanarImage &in, const Filter &filter, BorderMode border)
+{
+    out->resize(in.width, in.height, in.colors.size(), !in.opaque());
+
+    planarConvolution(out, in, filter, border, 0, in.height);
+}
+
+
+void convolveIterate(Image &image, const Filter &filter, unsigned n, BorderMode border)
+{
+    size_t bandRows, bandColumns;
+    const size_t block = iterationBlock(filter, image.width, &bandRows, &bandColumns);
+    Image bands[2];
+    Workspace workspace;
+
+    pingPong(image, n, block, [&](Image *out, const Image &in, size_t k) {
+        if (k == 1) {
+            convolution(out, in, filter, border);
+            return;
         }
+        for (size_t y = 0; y < in.height; y += bandRows)
+            for (size_t x = 0; x < in.width; x += bandColumns)
+                iterateBand(out, in, filter, border, k, x, std::min(in.width, x + bandColumns),
+                            y, std::min(in.height, y + bandRows), bands, workspace);
+    });
+}
+
+
+void convolution(Image *out, const Image &in, const Filter &filter, const std::vector<Region> &regions,
+                 BorderMode border)
+{
+    regionOutput(out, in.width, in.height);
+
+    const std::vector<Region> tiles = regionTiles(regions, in.width, in.height, in.width, in.height);
+    Workspace workspace;
+    for (size_t i = 0; i < tiles.size(); ++i) {
+        const Region &r = tiles[i];
+        tileConvolution(out, in, filter, border, r.x, r.x + r.width, r.y, r.y + r.height, workspace);
     }
 }
@@ -0,0 +1,94 @@
+#include <algorithm>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <omp.h>
+#include "../bootstrap/bootstrap.h"
+#include "../kernels/kernels.h"
+
+
+static const size_t defaultStripHeight = 256;
+static const size_t bandHeight = 64;
+
+
+int usage(const char* bin)
+{
+    std::cerr << "Usage: " << bin << " [picture.ppm|pam] [filter] [output.ppm|pam]"
+              << " [strip rows] [border: wrap|clamp|mirror|zero]" << std::endl;
+    return 1;
+}
+
+
+// elapsed in milliseconds
+static double getElapsed(struct timespec &end, struct timespec &start)
+{
+    double startns = start.tv_sec * 1000000000LL + start.tv_nsec;
+    double endns   = end.tv_sec * 1000000000LL + end.tv_nsec;
+    return (endns - startns) / 1000000;
+}
+
+
+// Convolves the image one horizontal strip at a time, so only
+// strip + filter.height - 1 input rows and strip output rows are in memory
+int main(int argc, const char *argv[])
+{
+    if (argc < 4)
+        return usage(argv[0]);
+
+    const char *imagePath  = argv[1];
+    const char *filterPath = argv[2];
+    const char *outputPath = argv[3];
+    const size_t stripHeight = (argc > 4) ? std::max(1l, atol(argv[4])) : defaultStripHeight;
+    const char *borderName = (argc > 5) ? argv[5] : "wrap";
+
+    std::cout << "Image:  " << imagePath << std::endl
+              << "Filter: " << filterPath << std::endl
+              << "Border: " << borderName << std::endl
+              << "Strip:  " << stripHeight << " rows" << std::endl;
+
+    try {
+        BorderMode border = parseBorderMode(borderName);
+
+        Filter filter;
+        initFilterFromFile(&filter, filterPath);
+
+        RowReader reader(imagePath);
+        RowWriter writer(outputPath, reader.width, reader.height);
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+
+        // Output row y0 + i is row half + i of both strips
+        const size_t half = filter.height / 2;
+        Image in, out;
+
+        for (size_t y0 = 0; y0 < reader.height; y0 += stripHeight) {
+            const size_t n = std::min(stripHeight, reader.height - y0);
+
+            readStrip(&in, reader, y0, n, filter, border);
+            out.resize(in.width, in.height);
+
+            #pragma omp parallel for schedule(dynamic)
+            for (size_t y = half; y < half + n; y += bandHeight)
+                bandConvolution(&out, in, filter, border, y, std::min(half + n, y + bandHeight));
+
+            for (size_t i = 0; i < n; ++i)
+                writer.writeRow(out.row(half + i));
+        }
+
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+
+        double elapsed = getElapsed(end, start);
+        std::cout << "Took " << elapsed << " milliseconds, including I/O"
+                  << std::endl
+                  << "(" << elapsed / 1000 << " seconds)"
+                  << std::endl;
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return -1;
+    }
+
+    return 0;
+}